@@ -12,6 +12,8 @@
 //    has been found in the output of an application between repeated
 //    runs with the same input data. It is not intended to be used in
 //    regular producition, or become a permanent part of any application.
+//    To leave it running on production jobs, sample a fraction of the
+//    work with options().sample_blocks or options().sample_channels.
 // 2) The first time you run your dilog-instrumented application in a
 //    given directory, it will write its output file into the cwd. 
 //    Running it a second time in the same directory will check the
@@ -28,7 +30,11 @@
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <cstdarg>
 #include <iostream>
@@ -37,11 +43,96 @@
 #include <string>
 #include <thread>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <mutex>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <type_traits>
+#include <cmath>
+#include <cctype>
+#include <memory>
+#include <functional>
+
+// Set DILOG_MMAP to 0 at compile time to read dilog files in check mode
+// through std::ifstream, otherwise they are memory-mapped if possible.
+#ifndef DILOG_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define DILOG_MMAP 1
+#else
+#define DILOG_MMAP 0
+#endif
+#endif
+
+// Set DILOG_ZLIB to 1 at compile time, and link with -lz, to be able to
+// write compressed dilog files with options().compress_output, and to
+// read them back in check mode.
+#ifndef DILOG_ZLIB
+#define DILOG_ZLIB 0
+#endif
+
+#if DILOG_ZLIB
+#include <zlib.h>
+#endif
+
+#if DILOG_MMAP
+#include <sys/mman.h>
+#endif
 
 #define DILOG_LOGO "---DILOG------DILOG------DILOG---"
+#define DILOG_INDEX_MAGIC "DILOGIDX"
+#define DILOG_FORMAT_MIN 256
+#define DILOG_CHUNK_SIZE 65536
+#define DILOG_REPORT_ATTEMPTS 32
+
+// Binary dilog files begin with the magic string below, followed by a
+// sequence of records, each made of a tag byte, the block path id and
+// payload length encoded as varints, the payload, and a 32-bit hash of
+// the record. Block paths are interned, each one defined by a path
+// record carrying its id before the first record that refers to it.
+#define DILOG_BINARY_MAGIC "DILOGBIN"
+#define DILOG_BINARY_HEADER 8
+#define DILOG_VARINT_MAX 10
+#define DILOG_TAG_ENTER '['
+#define DILOG_TAG_EXIT ']'
+#define DILOG_TAG_MESSAGE 'm'
+#define DILOG_TAG_PATH 'p'
+
+// Compressed dilog files begin with the magic string below, followed by
+// a sequence of frames, each one a header with the compressed and
+// uncompressed sizes as 32-bit integers followed by the deflated bytes
+// of the next options().compress_frame bytes of the stream. The file ends
+// with an index of the file and stream offsets of every frame, the frame
+// count, and the trailer magic string. A file without the trailer, eg.
+// from a job that was killed, is still readable by scanning its frames.
+#define DILOG_FRAME_MAGIC "DILOGZF1"
+#define DILOG_FRAME_TRAILER "DILOGZX1"
+#define DILOG_FRAME_HEADER 8
+
+// Block modes, selected by the optional mode argument to the dilog::block
+// constructor. Iterations of a DILOG_BLOCK_DIGEST block are matched in
+// check mode as a whole, by a digest of their complete contents, see
+// dilog::block::match_digest.
+#define DILOG_BLOCK_ORDERED 0
+#define DILOG_BLOCK_DIGEST 1
+
+// Set DILOG_TRACE to 0 at compile time to remove all of the internal
+// call tracing from dilog, otherwise options().trace_level selects how
+// much of it is done at runtime, from DILOG_TRACE_NONE up to
+// DILOG_TRACE_FILE where every call is logged to file trace.dilog.
+#ifndef DILOG_TRACE
+#define DILOG_TRACE 1
+#endif
+#define DILOG_TRACE_NONE 0
+#define DILOG_TRACE_STACK 1
+#define DILOG_TRACE_FILE 2
 
 #ifndef DILOG_HEADER_INCLUDED_
 #define DILOG_HEADER_INCLUDED_ 1
@@ -59,8 +150,12 @@ class dilog {
  // written if open for writing. Any mismatch between a printf message and
  // the corresponding record in myapp.dilog will report a runtime error.
 
+ protected:
+   struct block_set;
+
  public:
    class trace;
+   class channel;
    class block {
 
     // Objects of class dilog::block are constructed by the user inside a
@@ -72,71 +167,133 @@ class dilog {
 
     private:
       std::string chan;        // name of associated channel
-      std::string name;        // name of block, eg. "loop1"
-      std::string prefix;      // slash-delimited pathname prefix of block
-      std::streampos base;     // file offset to current iteration of this block
-      unsigned int beginline;  // file line number associated with base
+      const std::string *path; // full pathname of block, see setPath
+      unsigned int pathid;     // id of path on this channel, see block_node
+      unsigned int beginline;  // file line number preceding this iteration
       unsigned int ireplay;    // offset in dilog::fRecord where replay starts
+      int mode;                // DILOG_BLOCK_ORDERED or DILOG_BLOCK_DIGEST
+      bool owned;              // owned by the channel, not the user
+      dilog *skipped;          // channel, if not sampled, see sample_blocks
       block *parent;           // pointer to the block containing this one
+      block *saved;            // spare copy to reuse at exit, see ~block
 
-      // blinks contains information about all of the unmatched iterations
-      // of inner blocks that have been encountered so far in searching the
-      // current iteration of this block. The blinks are indexed by the
-      // block path, and consists of key-value pairs where the key is the
-      // stream offset in the input file where the unmatched iteration begins,
-      // and the value is the corresponding line number. Entries in blinks
-      // are inserted by next() and erased by exit() upon completion
-      // of a successful block match.
-      std::map<std::string, std::map<std::streampos, unsigned int> > blinks;
-
-      // flinks is similar to blinks, except that it points to the first
-      // line past the last iteration of the block set in the input stream.
-      // If flinks is not set, the input parser has not yet encountered
-      // the end of this block set.
-      std::map<std::string, std::map<std::streampos, unsigned int> > flinks;
+      // Each block_links object holds the state of the search through the
+      // set of iterations of one inner block, identified by its path id,
+      // within the current iteration of this block. blinks lists all of
+      // the unmatched iterations of the inner block that have been
+      // encountered so far, by the line number preceding the start of the
+      // iteration, in ascending order. Entries in blinks are inserted by
+      // next() and erased by enter() upon the start of a block match.
+      // flink is the last line of the final iteration of the block set in
+      // the input stream, or zero if the input parser has not yet found
+      // the end of the block set. bset points to the index of the block
+      // set if it has been scanned, see scan_set.
+      struct block_links {
+         unsigned int id;
+         std::vector<unsigned int> blinks;
+         unsigned int flink;
+         const block_set *bset;
+      };
+      std::vector<block_links> links;
 
       block()
-       : base(0), beginline(0), ireplay(0), parent(0)
+       : path(0), pathid(0), beginline(0), ireplay(0),
+         mode(DILOG_BLOCK_ORDERED), owned(true), skipped(0), parent(0),
+         saved(0)
       {}
 
     public:
       block(const std::string &channel, const std::string &blockname,
-                                        bool threadsafe=true)
-       : chan(channel), name(blockname)
+            bool threadsafe=true, int blockmode=DILOG_BLOCK_ORDERED)
+       : path(0), pathid(0), beginline(0), ireplay(0),
+         mode(blockmode), owned(false), skipped(0), saved(0)
       {
          // Initialize a new iteration of block with name blockname on the
          // named dilog channel, generating a new dilog channel if it does
          // not already exist. Normal behavior is to report a runtime error 
          // if access to this channel is attempted from more than one C++
          // execution thread. Set threadsafe = false to suppress this
-         // check, at the risk of creating race conditions.
+         // check, at the risk of creating race conditions. Set blockmode
+         // to DILOG_BLOCK_DIGEST if the order of the contents of each
+         // iteration is deterministic, so that in check mode iterations
+         // can be matched whole without any search, see match_digest.
          //
          // This constructor is only called from user code, never internally.
  
-         dilog &dlog = dilog::get(channel, threadsafe);
+         open(dilog::get(channel, threadsafe), blockname);
+      }
+
+      block(const channel &handle, const std::string &blockname,
+            int blockmode=DILOG_BLOCK_ORDERED)
+       : path(0), pathid(0), beginline(0), ireplay(0),
+         mode(blockmode), owned(false), skipped(0), saved(0)
+      {
+         // Same as above, for a channel held by a dilog::channel handle,
+         // which saves looking up the channel by name.
+ 
+         open(*handle, blockname);
+      }
+
+    private:
+      void open(dilog &dlog, const std::string &blockname)
+      {
+         // Start the new iteration of this block on channel dlog, or skip
+         // it if it is not sampled, see options().sample_blocks.
+
          parent = dlog.fBlock;
-         prefix = parent->getPath();
+         if (dlog.fSkipping || (options().sample_blocks > 1 &&
+                                parent->parent == 0 &&
+                                !dlog.sampled(parent->pathid, blockname)))
+         {
+            // A skipped block goes by the path of its parent.
+            skipped = &dlog;
+            path = parent->path;
+            pathid = parent->pathid;
+            ++dlog.fSkipping;
+            return;
+         }
+         chan = dlog.fChannel;
+         setPath(dlog, blockname);
+         dlog.settle_actual();
+         dlog.stop_if_aborted("dilog::block constructor");
          if (dlog.fError.size() > 0)
             dlog.clean_exit("dilog::block constructor");
-         if (dlog.fBlocks.find(getPath()) != dlog.fBlocks.end()) {
-            dlog.fBlocks[getPath()]->parent = 0;
-            delete dlog.fBlocks[getPath()];
+         block *&current = dlog.fNodes[pathid].current;
+         if (current) {
+            saved = current;
+            saved->parent = 0;
          }
-         dlog.fBlocks[getPath()] = this;
+         current = this;
+         ++dlog.fStats.enters;
          if (dlog.fWriting) {
-            *dlog.fWriting << "[" << getPath() << "[" << std::endl;
+            dlog.write_block(DILOG_TAG_ENTER, pathid);
             ++dlog.fLineno;
          }
+         else if (dlog.fDigesting) {
+            dlog.digest_record("[[", getPath());
+         }
+         else if (mode == DILOG_BLOCK_DIGEST && start_digest()) {
+            dlog.fDigesting = this;
+            dlog.fDigest = 14695981039346656037ull;
+            dlog.fDigestRecord.clear();
+         }
          else {
             trace t(*this, "constructor", "enter");
+            dlog.fPendingLine = dlog.fLineno;
             if (!enter()) {
                dlog.clean_exit("dilog::block constructor");
+               if (dlog.fActual) {
+                  // The actual stream starts with the entry that failed.
+                  dlog.write_block(DILOG_TAG_ENTER, pathid);
+                  ++dlog.fLineno;
+               }
             }
          }
          ireplay = dlog.fRecord.size();
          dlog.fBlock = this;
       }
 
+    public:
       ~block()
       {
          // Terminate an open iteration block. The names of the block and
@@ -161,25 +318,64 @@ class dilog {
                       << std::endl;
             traceback(std::cerr);
          }
-         if (parent == 0)
+         if (skipped) {
+            --skipped->fSkipping;
             return;
+         }
+         if (parent == 0) {
+            delete saved;
+            return;
+         }
 
          dilog &dlog = dilog::get(chan, false);
-         if (dlog.fError.size() > 0)
+         dlog.settle_actual();
+         if (dlog.fError.size() > 0) {
+            // Put back the state from before this iteration, so that the
+            // channel holds no pointers to this block once it is gone.
+            dlog.fNodes[pathid].current = saved;
+            if (dlog.fBlock == this)
+               dlog.fBlock = parent;
             return;
+         }
+         ++dlog.fStats.exits;
          if (dlog.fWriting) {
-            *dlog.fWriting << "]" << getPath() << "]" << std::endl;
+            dlog.write_block(DILOG_TAG_EXIT, pathid);
             ++dlog.fLineno;
          }
+         else if (dlog.fDigesting == this) {
+            dlog.fDigesting = 0;
+            trace t(*this, "destructor", "match_digest");
+            if (!match_digest()) {
+               dlog.clean_exit("dilog::block destructor");
+            }
+         }
+         else if (dlog.fDigesting) {
+            dlog.digest_record("]]", getPath());
+         }
          else {
             trace t(*this, "destructor", "exit");
             if (!exit()) {
                // std::cerr << "dilog::block destructor error: " 
                //          << dlog.fError << std::endl;
+               if (options().save_actual) {
+                  // Stop here rather than at the next call, so that the
+                  // actual stream goes on with the exit that failed.
+                  dlog.clean_exit("dilog::block destructor");
+                  if (dlog.fActual)
+                     dlog.write_text("]" + getPath() + "]");
+               }
             }
          }
-         dlog.fBlocks[getPath()] = new block(*this);
+         if (saved) {
+            saved->assign(*this);
+            dlog.fNodes[pathid].current = saved;
+         }
+         else {
+            dlog.fNodes[pathid].current = new block(*this);
+         }
          dlog.fBlock = parent;
+         if (dlog.fActual && parent->parent == 0)
+            dlog.end_actual("dilog::block destructor");
       }
 
       void print(std::ostream &serr=std::cerr)
@@ -190,52 +386,115 @@ class dilog {
  
          serr << "dilog::block(" << getPath() << ") {" << std::endl
               << "   chan: " << chan << "," << std::endl
-              << "   name: " << name << "," << std::endl
-              << "   prefix: " << prefix << "," << std::endl
-              << "   base: " << base << "," << std::endl
+              << "   pathid: " << pathid << "," << std::endl
               << "   beginline: " << beginline << "," << std::endl
               << "   ireplay: " << ireplay << "," << std::endl
               << "   parent: " << parent << "," << std::endl
-              << "   blinks: { ";
-         for (auto blink : blinks) {
-            if (blink.second.size() > 0) {
-               serr << std::endl
-                    << "      " << blink.first << ": {";
-               for (auto bpair : blink.second) {
-                  serr << std::endl
-                       << "         " << bpair.first
-                       << ": " << bpair.second << ",";
-               }
-               serr << "},";
-            }
-         }
-         serr << "}," << std::endl
-              << "   flinks: { ";
-         for (auto flink : flinks) {
-            if (flink.second.size() > 0) {
+              << "   links: { ";
+         dilog &dlog = dilog::get(chan, false);
+         for (auto &bl : links) {
+            if (bl.blinks.size() > 0 || bl.flink > 0) {
                serr << std::endl
-                    << "      " << flink.first << ": {";
-               for (auto fpair : flink.second) {
+                    << "      " << dlog.fNodes[bl.id].path << ": {";
+               for (auto line : bl.blinks) {
                   serr << std::endl
-                       << "         " << fpair.first
-                       << ": " << fpair.second << ",";
+                       << "         " << dlog.line_offset(line)
+                       << ": " << line << ",";
                }
-               serr << "},";
+               serr << "} flink: " << bl.flink << ",";
             }
          }
          serr << "}," << std::endl
               << "}" << std::endl;
       }
 
+      void set_tolerance(unsigned int ulps, double rel=0)
+      {
+         // Set the floating point tolerance of the messages in this
+         // block, including those in its inner blocks, in place of the
+         // channel tolerance, see dilog::set_tolerance. It applies to
+         // all iterations of the block from now on, and has no effect
+         // on a block that is skipped, see options().sample_blocks.
+ 
+         if (skipped)
+            return;
+         dilog &dlog = dilog::get(chan, false);
+         dlog.fTolerance[getPath()] = tolerance_t(ulps, rel);
+      }
+
     protected:
       block(const block &src)
-       : chan(src.chan), name(src.name), prefix(src.prefix),
-         base(0), beginline(0), ireplay(0), parent(0)
+       : chan(src.chan), path(src.path),
+         pathid(src.pathid), beginline(0), ireplay(0), mode(src.mode),
+         owned(true), skipped(0), parent(0), saved(0)
       {
          // Protected copy constructor, needed to save copies of
          // inactive blocks for potential use during replay.
       }
 
+      void assign(const block &src)
+      {
+         // Reset this saved copy of block src to the state of a new copy,
+         // keeping the storage it already holds for reuse. Both blocks
+         // have the same path, so only the iteration state changes.
+
+         beginline = 0;
+         ireplay = 0;
+         mode = src.mode;
+         parent = 0;
+         links.clear();
+      }
+
+      block_links *find_links(unsigned int id)
+      {
+         // Return the search state of the inner block set with path id,
+         // or null if there is none in the current iteration.
+
+         for (auto &bl : links) {
+            if (bl.id == id)
+               return &bl;
+         }
+         return 0;
+      }
+
+      block_links &get_links(unsigned int id)
+      {
+         // Same as find_links, creating the search state if necessary.
+         // References into links remain valid until the next call to
+         // get_links, or until links is cleared by enter() or next().
+
+         block_links *found = find_links(id);
+         if (found)
+            return *found;
+         links.push_back(block_links());
+         links.back().id = id;
+         links.back().flink = 0;
+         links.back().bset = 0;
+         return links.back();
+      }
+
+      static void add_link(std::vector<unsigned int> &blinks,
+                           unsigned int line)
+      {
+         auto iter = std::lower_bound(blinks.begin(), blinks.end(), line);
+         if (iter == blinks.end() || *iter != line)
+            blinks.insert(iter, line);
+      }
+
+      static void drop_link(std::vector<unsigned int> &blinks,
+                            unsigned int line)
+      {
+         auto iter = std::lower_bound(blinks.begin(), blinks.end(), line);
+         if (iter != blinks.end() && *iter == line)
+            blinks.erase(iter);
+      }
+
+      static bool has_link(const std::vector<unsigned int> &blinks,
+                           unsigned int line)
+      {
+         return std::binary_search(blinks.begin(), blinks.end(), line);
+      }
+
       bool enter()
       {
          // This method is called when a dilog channel open in read mode
@@ -245,42 +504,38 @@ class dilog {
          // once enter() has done its thing.
  
          dilog &dlog = dilog::get(chan, false);
+         timer clock(dlog.fStats.enter_ns);
+         links.clear();
          beginline = dlog.fLineno;
-         base = dlog.fReading->tellg();
+         index_set();
          std::string mexpected = "[" + getPath() + "[";
          std::string nextmsg;
-         for (; !std::getline(*dlog.fReading, nextmsg).bad();) {
-            ++dlog.fLineno;
-            dlog.verify_line(nextmsg, dlog.fLineno);
+         for (; dlog.read_next(nextmsg);) {
+            block_links &bl = parent->get_links(pathid);
             if (nextmsg == mexpected) {
                if (dlog.fReplay) {
                   // std::cerr << "block::enter replays match step " 
                   //          << dlog.fReplay-1 << "/" << dlog.fRecord.size()
                   //          << " at lineno " << dlog.fLineno 
                   //          << ": [[" << getPath() << std::endl;
-                  dlog.fMatched[dlog.fReplay-1] = dlog.fLineno;
+                  dlog.set_matched(dlog.fReplay-1, dlog.fLineno);
                }
                else {
                   // std::cerr << "block::enter records match step " 
                   //           << dlog.fRecord.size() << " at lineno "
                   //           << dlog.fLineno << ": [[" << getPath()
                   //           << std::endl;
-                  dlog.fMatched[dlog.fRecord.size()] = dlog.fLineno;
-                  dlog.fRecord.push_back("[[" + getPath());
+                  dlog.set_matched(dlog.fRecord.size(), dlog.fLineno);
+                  dlog.push_record("[[", getPath());
                   dlog.logger("[" + getPath() + "[");
                }
                break;
             }
-            else if (parent->blinks[getPath()].size() > 0 &&
-                     parent->flinks[getPath()].size() == 0)
-            {
-               parent->flinks[getPath()][base] = beginline;
-               base = parent->blinks[getPath()].begin()->first;
-               beginline = parent->blinks[getPath()].begin()->second;
-               parent->blinks[getPath()].erase(base);
-               dlog.fReading->clear();
-               dlog.fReading->seekg(base);
-               dlog.fLineno = beginline;
+            else if (bl.blinks.size() > 0 && bl.flink == 0) {
+               bl.flink = beginline;
+               beginline = bl.blinks.front();
+               bl.blinks.erase(bl.blinks.begin());
+               dlog.seek_line(beginline);
                trace t(*this, "enter", "enter");
                return enter();
             }
@@ -288,7 +543,6 @@ class dilog {
                trace t(*this, "enter", "parent.next");
                if (parent->next(nextmsg)) {
                   beginline = dlog.fLineno;
-                  base = dlog.fReading->tellg();
                   continue;
                }
             }
@@ -296,28 +550,158 @@ class dilog {
                           "expected new block"
                           " \"" + getPath() + "\""
                           " at line " + std::to_string(dlog.fLineno)
-                          + " in " + chan + ".dilog "
+                          + " in " + dlog.fInput + ".dilog "
                           "but found \"" + nextmsg + "\" instead.";
             return false;
          }
-         parent->blinks[getPath()].erase(base);
+         drop_link(parent->get_links(pathid).blinks, beginline);
          dlog.fBlock = this;
          return true;
       }
 
+      void index_set()
+      {
+         // Index the set of iterations of this block that begins at the
+         // current input line, unless it has already been indexed in the
+         // current iteration of the parent block, see dilog::scan_set.
+
+         if (!options().index_blocks)
+            return;
+         block_links &bl = parent->get_links(pathid);
+         if (bl.flink > 0)
+            return;
+         dilog &dlog = dilog::get(chan, false);
+         const block_set *bset = dlog.scan_set(getPath(), dlog.fLineno);
+         if (bset) {
+            if (bl.blinks.size() == 0)
+               bl.blinks = bset->lines;
+            else {
+               for (auto line : bset->lines)
+                  add_link(bl.blinks, line);
+            }
+            bl.flink = bset->endline;
+            bl.bset = bset;
+         }
+      }
+
+      bool start_digest()
+      {
+         // Check whether a new iteration of this digest-mode block can be
+         // matched by its digest, which needs the index of its block set.
+         // If so, the contents of the iteration are collected at runtime
+         // without reading the input, to be matched by match_digest when
+         // the iteration ends.
+
+         dilog &dlog = dilog::get(chan, false);
+         if (dlog.fReplay)
+            return false;
+         index_set();
+         block_links &bl = parent->get_links(pathid);
+         return (bl.bset != 0 && bl.blinks.size() > 0);
+      }
+
+      bool match_digest()
+      {
+         // Match the completed runtime iteration of this digest-mode block,
+         // collected in dilog::fDigestRecord, against the unmatched recorded
+         // iterations of its block set with the same digest. If none is
+         // found, the collected blocks and messages are checked against the
+         // input one at a time, exactly as if they had been checked while
+         // the iteration ran, so that any divergence is reported at the
+         // line where it happens. Return false on error.
+
+         dilog &dlog = dilog::get(chan, false);
+         block_links &bl = parent->get_links(pathid);
+         const block_set &bset = *bl.bset;
+         auto range = bset.digests.equal_range(dlog.fDigest);
+         unsigned int match = bset.lines.size();
+         for (auto diter = range.first; diter != range.second; ++diter) {
+            if (diter->second < match &&
+                has_link(bl.blinks, bset.lines[diter->second]))
+            {
+               match = diter->second;
+            }
+         }
+         record_list contents;
+         std::swap(contents, dlog.fDigestRecord);
+         if (match == bset.lines.size()) {
+            {
+               trace t(*this, "match_digest", "enter");
+               if (!enter())
+                  return dlog.save_digest(*this, contents, 0, false);
+            }
+            ireplay = dlog.fRecord.size();
+            for (size_t i=0; i < contents.size(); ++i) {
+               if (dlog.fActual)
+                  return dlog.save_digest(*this, contents, i, true);
+               record_list::record rec = contents[i];
+               if (rec.tagged("[[")) {
+                  block *binner = dlog.find_child(dlog.fBlock->pathid,
+                                                  rec.data + 2, rec.size - 2);
+                  if (binner == 0) {
+                     dlog.fError = "dilog::block::match_digest error: "
+                                   "prior block " + rec.body() +
+                                   " missing, cannot continue";
+                     return false;
+                  }
+                  binner->parent = dlog.fBlock;
+                  trace t(*this, "match_digest", "child.enter");
+                  if (!binner->enter())
+                     return dlog.save_digest(*this, contents, i, true);
+                  binner->ireplay = dlog.fRecord.size();
+               }
+               else if (rec.tagged("]]")) {
+                  trace t(*this, "match_digest", "child.exit");
+                  if (!dlog.fBlock->exit())
+                     return dlog.save_digest(*this, contents, i, true);
+               }
+               else {
+                  std::string line = "[" + dlog.fBlock->getPath() + "]";
+                  line.append(rec.data + 2, rec.size - 2);
+                  dlog.check_line(line.data(), line.size());
+               }
+            }
+            size_t n = contents.size();
+            if (dlog.fActual)
+               return dlog.save_digest(*this, contents, n, true);
+            trace t(*this, "match_digest", "exit");
+            return exit() || dlog.save_digest(*this, contents, n, true);
+         }
+         beginline = bset.lines[match];
+         drop_link(bl.blinks, beginline);
+         dlog.fLineno = beginline + 1;
+         dlog.push_record("[[", getPath());
+         dlog.logger("[" + getPath() + "[");
+         for (size_t i=0; i < contents.size(); ++i)
+            dlog.fRecord.push_back(contents[i]);
+         dlog.fLineno = bset.ends[match];
+         dlog.push_record("]]", getPath());
+         dlog.logger("]" + getPath() + "]");
+         if (parent->parent == 0) {
+            dlog.clear_record();
+            dlog.trim_sets(*parent);
+         }
+         if (bl.blinks.size() > 0)
+            dlog.seek_line(bl.blinks.front());
+         else
+            dlog.seek_line(bl.flink);
+         return true;
+      }
+
       bool exit()
       {
          // This method is called when a dilog channel open in read mode
          // exits a block and ascends a level in the block stack.
 
          dilog &dlog = dilog::get(chan, false);
+         timer clock(dlog.fStats.exit_ns);
          if (dlog.fBlock != this) {
             dlog.fError = "dilog::block::exit error: "
                           "block nesting error, expected block " +
                           getPath() + " but found " + dlog.fBlock->getPath();
             return false;
          }
-         while (blinks[getPath()].size() != 0) {
+         while (find_links(pathid) && find_links(pathid)->blinks.size() != 0) {
             trace t(*this, "exit", "next");
             if (!next())
                continue;
@@ -327,27 +711,25 @@ class dilog {
          }
          std::string mexpected = "]" + getPath() + "]";
          std::string nextmsg;
-         for (; !std::getline(*dlog.fReading, nextmsg).bad();) {
-            ++dlog.fLineno;
-            dlog.verify_line(nextmsg, dlog.fLineno);
+         for (; dlog.read_next(nextmsg);) {
             if (nextmsg == mexpected) {
                if (dlog.fReplay) {
                   // std::cerr << "block::exit replays match step " 
                   //           << dlog.fReplay << "/" << dlog.fRecord.size()
                   //           << " at lineno " << dlog.fLineno 
                   //           << ": ]]" << getPath()
-                  //           << " with " << parent->blinks[getPath()].size()
+                  //           << " with " << parent->get_links(pathid).blinks.size()
                   //           << " iterations still unmatched" << std::endl;
-                  dlog.fMatched[dlog.fReplay] = dlog.fLineno;
+                  dlog.set_matched(dlog.fReplay, dlog.fLineno);
                }
                else {
                   // std::cerr << "block::exit records match step " 
                   //           << dlog.fRecord.size() << " at lineno "
                   //           << dlog.fLineno << ": ]]" << getPath()
-                  //           << " with " << parent->blinks[getPath()].size()
+                  //           << " with " << parent->get_links(pathid).blinks.size()
                   //           << " iterations still unmatched" << std::endl;
-                  dlog.fMatched[dlog.fRecord.size()] = dlog.fLineno;
-                  dlog.fRecord.push_back("]]" + getPath());
+                  dlog.set_matched(dlog.fRecord.size(), dlog.fLineno);
+                  dlog.push_record("]]", getPath());
                   dlog.logger("]" + getPath() + "]");
                }
                break;
@@ -366,30 +748,22 @@ class dilog {
                           "expected end of block "
                           "\"" + getPath() + "\" at line " + 
                           std::to_string(dlog.fLineno) + 
-                          " in " + chan + ".dilog"
+                          " in " + dlog.fInput + ".dilog"
                           " but found \"" + nextmsg + "\""
                           " instead of \"" + mexpected + "\"";
             return false;
          }
          if (parent->parent == 0) {
-            dlog.fMatched.clear();
-            dlog.fRecord.clear();
+            dlog.clear_record();
+            dlog.trim_sets(*parent);
          }
-         if (parent->flinks[getPath()].size() > 0) {
-            if (parent->blinks[getPath()].size() > 0) {
-               base = parent->blinks[getPath()].begin()->first;
-               beginline = parent->blinks[getPath()].begin()->second;
-               dlog.fReading->clear();
-               dlog.fReading->seekg(base);
-               dlog.fLineno = beginline;
-            }
-            else {
-               base = parent->flinks[getPath()].begin()->first;
-               beginline = parent->flinks[getPath()].begin()->second;
-               dlog.fReading->clear();
-               dlog.fReading->seekg(base);
-               dlog.fLineno = beginline;
-            }
+         block_links &bl = parent->get_links(pathid);
+         if (bl.flink > 0) {
+            if (bl.blinks.size() > 0)
+               beginline = bl.blinks.front();
+            else
+               beginline = bl.flink;
+            dlog.seek_line(beginline);
          }
          dlog.fBlock = parent;
          return true;
@@ -406,22 +780,23 @@ class dilog {
          // up to the point immediately preceding the check of lastmsg.
  
          dilog &dlog = dilog::get(chan, false);
+         timer clock(dlog.fStats.next_ns);
+         ++dlog.fStats.backtracks;
          if (parent == 0) {
             dlog.fError = "dilog::block::next error: "
                           "no more iterations to search.";
             return false;
          }
-         blinks.clear();
-         flinks.clear();
-         parent->blinks[getPath()][base] = beginline;
-         auto flink = parent->flinks[getPath()];
-         if (flink.size() > 0) {
-            auto blink = parent->blinks[getPath()];
-            auto biter = blink.find(base);
-            if (biter != blink.end() && ++biter != blink.end()) {
-               dlog.fReading->clear();
-               dlog.fReading->seekg(biter->first);
-               dlog.fLineno = biter->second;
+         links.clear();
+         block_links &bl = parent->get_links(pathid);
+         add_link(bl.blinks, beginline);
+         if (bl.flink > 0) {
+            auto biter = std::upper_bound(bl.blinks.begin(), bl.blinks.end(),
+                                          beginline);
+            if (biter != bl.blinks.end() && bl.bset)
+               biter = next_candidate(*bl.bset, bl.blinks, biter);
+            if (biter != bl.blinks.end()) {
+               dlog.seek_line(*biter);
             }
             else {
                trace t(*this, "next", "parent.next");
@@ -432,9 +807,7 @@ class dilog {
             std::string mexpected = "]" + getPath() + "]";
             if (lastmsg != mexpected) {
                std::string nextmsg;
-               for (; !std::getline(*dlog.fReading, nextmsg).bad();) {
-                  ++dlog.fLineno;
-                  dlog.verify_line(nextmsg, dlog.fLineno);
+               for (; dlog.read_next(nextmsg) && !dlog.fReading->fail();) {
                   if (nextmsg == mexpected) {
                      break;
                   }
@@ -448,6 +821,8 @@ class dilog {
                dlog.fError = "dilog::block::next error: " + dlog.fError;
                return false;
             }
+            if (options().report_divergence)
+               dlog.note_attempt(*this, 0, "");
          }
          if (dlog.fError.size() == 0) {
             trace t(*this, "next", "replay");
@@ -461,6 +836,36 @@ class dilog {
          return true;
       }
 
+      std::vector<unsigned int>::iterator
+      next_candidate(const block_set &bset,
+                     std::vector<unsigned int> &blinks,
+                     std::vector<unsigned int>::iterator biter)
+      {
+         // Return the first unmatched iteration in blink, starting from
+         // biter, whose leading direct messages (those not inside any
+         // inner block) agree with the messages seen so far at runtime
+         // in this iteration. Iterations that disagree cannot match, so
+         // the search skips over them using the key index in bset.
+ 
+         dilog &dlog = dilog::get(chan, false);
+         uint64_t key;
+         if (dlog.fTolerance.size() > 0 || dlog.runtime_key(*this, key) == 0)
+            return biter;
+         auto kiter = bset.keys.find(key);
+         if (kiter == bset.keys.end())
+            return blinks.end();
+         const std::vector<unsigned int> &cands = kiter->second;
+         auto citer = std::lower_bound(cands.begin(), cands.end(), *biter);
+         for (; citer != cands.end(); ++citer) {
+            biter = std::lower_bound(biter, blinks.end(), *citer);
+            if (biter == blinks.end())
+               break;
+            else if (*biter == *citer)
+               return biter;
+         }
+         return blinks.end();
+      }
+
       bool replay()
       {
          // Entry here assumes that this block is currently entered on the
@@ -475,24 +880,26 @@ class dilog {
          }
          std::string mexpected;
          for (; dlog.fReplay < dlog.fRecord.size(); ++dlog.fReplay) {
-            mexpected = dlog.fRecord[dlog.fReplay];
-            if (mexpected.find("[[") == 0) {
-               block *binner;
-               std::string path = mexpected.substr(2);
-               if (dlog.fBlocks.find(path) != dlog.fBlocks.end()) {
-                  binner = dlog.fBlocks[path];
+            ++dlog.fStats.replay_steps;
+            record_list::record rec = dlog.fRecord[dlog.fReplay];
+            if (rec.tagged("[[")) {
+               block *binner = dlog.find_child(pathid, rec.data + 2,
+                                               rec.size - 2);
+               if (binner) {
                   binner->parent = this;
                   binner->ireplay = ++dlog.fReplay;
-                  trace *t = new trace(*this, "replay", "child.enter");
-                  binner->enter();
-                  delete t;
+                  {
+                     trace t(*this, "replay", "child.enter");
+                     binner->enter();
+                  }
                   if (dlog.fError.size() > 0) {
                      dlog.fError = "dilog::block::replay error: " + dlog.fError;
                      return false;
                   }
-                  t = new trace(*this, "replay", "child.replay");
-                  binner->replay();
-                  delete t;
+                  {
+                     trace t(*this, "replay", "child.replay");
+                     binner->replay();
+                  }
                   if (dlog.fError.size() > 0) {
                      dlog.fError = "dilog::block::replay error: " + dlog.fError;
                      return false;
@@ -500,9 +907,10 @@ class dilog {
                   if (!dlog.fReplay)
                      break;
                   if (dlog.fReplay < dlog.fRecord.size()) {
-                     t = new trace(*this, "replay", "child.exit");
-                     binner->exit();
-                     delete t;
+                     {
+                        trace t(*this, "replay", "child.exit");
+                        binner->exit();
+                     }
                      if (dlog.fError.size() > 0) {
                         dlog.fError = "dilog::block::replay error: " + dlog.fError;
                         return false;
@@ -518,8 +926,8 @@ class dilog {
                   return false;
                }
             }
-            else if (mexpected.find("]]") == 0) {
-               if (mexpected.substr(2) == getPath()) {
+            else if (rec.tagged("]]")) {
+               if (rec == getPath()) {
                   return true;
                }
                else {
@@ -528,12 +936,19 @@ class dilog {
                }
             }
             else {
-               mexpected = "[" + getPath() + "]" + mexpected.substr(2);
+               mexpected = "[" + getPath() + "]";
+               mexpected.append(rec.data + 2, rec.size - 2);
                std::string nextmsg;
-               for (; !std::getline(*dlog.fReading, nextmsg).bad();) {
-                  ++dlog.fLineno;
-                  dlog.verify_line(nextmsg, dlog.fLineno);
-                  if (nextmsg != mexpected) {
+               for (; dlog.read_next(nextmsg);) {
+                  if (nextmsg != mexpected &&
+                      (dlog.fTolerance.size() == 0 ||
+                       !dlog.tolerant_match(this, nextmsg.data(),
+                                            nextmsg.size(), mexpected.data(),
+                                            mexpected.size())))
+                  {
+                     if (options().report_divergence)
+                        dlog.note_attempt(*this, dlog.fReplay - ireplay,
+                                          nextmsg);
                      trace t(*this, "replay", "next");
                      return next(nextmsg);
                   }
@@ -541,7 +956,7 @@ class dilog {
                   //           << dlog.fReplay << "/" << dlog.fRecord.size()
                   //           << " at lineno " << dlog.fLineno << ": "
                   //           << mexpected << std::endl;
-                  dlog.fMatched[dlog.fReplay] = dlog.fLineno;
+                  dlog.set_matched(dlog.fReplay, dlog.fLineno);
                   break;
                }
             }
@@ -549,11 +964,19 @@ class dilog {
          return true;
       }
 
-      std::string getPath() const {
+      const std::string &getPath() const {
+         return *path;
+      }
+
+      void setPath(dilog &dlog, const std::string &name="") {
+         // Attach this block to its node in the tree of block paths on
+         // the channel, as the inner block name of its parent, or as the
+         // root of the tree if it has no name, see dilog::block_node.
          if (name.size() > 0)
-            return prefix + "/" + name;
+            pathid = dlog.child_path(parent->pathid, name);
          else
-            return chan;
+            pathid = dlog.root_path(chan);
+         path = &dlog.fNodes[pathid].path;
       }
 
       friend class dilog;
@@ -564,6 +987,7 @@ class dilog {
       friend class trace;
       void traceback(std::ostream &serr) {
          serr << "Traceback on dilog::block " << getPath() << ":" << std::endl;
+#if DILOG_TRACE
          std::stack<trace*> spool;
          std::string caller;
          for (unsigned int depth=0; traces.size() > 0; ++depth) {
@@ -585,46 +1009,62 @@ class dilog {
             traces.push(t);
             spool.pop();
          }
+#endif
       }
    };
 
+#if DILOG_TRACE
    class trace {
 
     // Helper class for tracing calls to the dilog and dilog::block
-    // class methods. These can be disabled once debugging is done.
+    // class methods. These can be disabled once debugging is done,
+    // at runtime by setting dilog::options().trace_level, or else
+    // compiled out completely by building with -DDILOG_TRACE=0.
 
     private:
-      std::string caller;
-      std::string callee;
-      std::string channel;
+      const char *caller;
+      const char *callee;
       unsigned int lineno;
       unsigned int replay;
       block *target;
 
     public:
-      trace(block &b, std::string from, std::string to)
-       : caller(from), callee(to), channel(b.chan), target(&b)
+      trace(block &b, const char *from, const char *to)
+       : caller(from), callee(to), target(0)
       {
-         dilog &dlog = dilog::get(channel, false);
+         int level = options().trace_level;
+         if (level < DILOG_TRACE_STACK)
+            return;
+         target = &b;
+         dilog &dlog = dilog::get(target->chan, false);
          lineno = dlog.fLineno;
          replay = dlog.fReplay;
-         tracefile() << "[" << fullstack().size() << "." 
-                     << target->traces.size() << "] "
-                     << target->getPath() << "." << caller << " >> " << callee
-                     << " at line " << lineno << " with replay=" << replay
-                     << std::endl;
+         if (level >= DILOG_TRACE_FILE) {
+            std::lock_guard<std::mutex> guard(tracelock());
+            tracefile() << "[" << fullstack().size() << "." 
+                        << target->traces.size() << "] "
+                        << target->getPath() << "." << caller << " >> "
+                        << callee << " at line " << lineno
+                        << " with replay=" << replay << std::endl;
+         }
          target->traces.push(this);
          pushstack(this);
       }
 
       ~trace() {
-         dilog &dlog = dilog::get(channel, false);
-         tracefile() << "[" << fullstack().size() << "." 
-                     << target->traces.size() << "] "
-                     << target->getPath() << "." << caller << " << " << callee
-                     << " at line " << lineno << "=>" << dlog.fLineno
-                     << " with replay=" << replay << "=>" << dlog.fReplay
-                     << "/" << dlog.fRecord.size() << std::endl;
+         if (target == 0)
+            return;
+         if (options().trace_level >= DILOG_TRACE_FILE) {
+            dilog &dlog = dilog::get(target->chan, false);
+            std::lock_guard<std::mutex> guard(tracelock());
+            tracefile() << "[" << fullstack().size() << "." 
+                        << target->traces.size() << "] "
+                        << target->getPath() << "." << caller << " << "
+                        << callee << " at line " << lineno << "=>"
+                        << dlog.fLineno << " with replay=" << replay
+                        << "=>" << dlog.fReplay << "/" << dlog.fRecord.size()
+                        << std::endl;
+         }
          if (this == target->traces.top()) {
             target->traces.pop();
             popstack(this);
@@ -641,13 +1081,18 @@ class dilog {
       std::ostream &tracefile() {
          static std::ofstream tfile;
          if (!tfile.good())
-            tfile.open("trace.dilog");
+            tfile.open((file_stem("trace") + ".dilog").c_str());
          if (tfile.good())
             return tfile;
          else
             return std::cerr;
       }
 
+      std::mutex &tracelock() {
+         static std::mutex mutex;
+         return mutex;
+      }
+
     protected:
       void pushstack(trace *item) {
          fullstack().push(item);
@@ -664,277 +1109,4552 @@ class dilog {
          fullstack().pop();
       }
       std::stack<trace*>& fullstack() {
-         static std::stack<trace*> stack;
+         static thread_local std::stack<trace*> stack;
          return stack;
       }
 
       friend class block;
    };
+#else
+   class trace {
 
-   dilog(const std::string& channel)
-    : fLineno(0), fChannel(channel), fReplay(0)
-   {
-      std::string fname(channel);
-      fname += ".dilog";
-      fReading = new std::ifstream(fname.c_str());
-      if (fReading->good()) {
-         fWriting = 0;
-         fLogging = new std::ofstream((fname + "2").c_str());
-         if (!fLogging->good()) {
-            fError = "dilog constructor error - unable to open "
-                     "output dilog2 file, this is a fatal error.";
-         }
+    // Tracing is compiled out, this stub is optimized away entirely.
+
+    public:
+      trace(block &, const char *, const char *) {}
+   };
+#endif
+
+   class mapped_buffer : public std::streambuf {
+
+    // Read-only stream buffer over a dilog input stream held in memory,
+    // either a memory-mapped dilog file or the stream of a channel read
+    // from a container file. Seeks are pointer assignments, and the
+    // reader examines lines in place through cur() and end() without
+    // copying them out.
+
+    public:
+      mapped_buffer(const char *data, size_t size)
+       : fData((char*)data), fSize(size), fOwned(false)
+      {
+         // View size bytes at data, which must outlive this object.
+         setg(fData, fData, fData + fSize);
       }
-      else {
-         fReading = 0;
-         fLogging = 0;
-         fWriting = new std::ofstream(fname.c_str());
-         if (!fWriting->good()) {
-            fError = "dilog constructor error - unable to open "
-                     "output dilog file, this is a fatal error.";
-         }
+
+      mapped_buffer(std::vector<char> &data)
+       : fData(0), fSize(data.size()), fOwned(false)
+      {
+         // Take over the contents of data.
+         fCopy.swap(data);
+         fData = fCopy.data();
+         setg(fData, fData, fData + fSize);
       }
-      static std::mutex mutex;
-      std::lock_guard<std::mutex> guard(mutex);
-      dilogs_map_t &dilogs = get_map();
-      std::thread::id tid = std::this_thread::get_id();
-      if (dilogs.find(channel) == dilogs.end()) {
-         dilogs[channel] = this;
-         fThread_id = tid;
+
+#if DILOG_MMAP
+      mapped_buffer(const std::string &fname)
+       : fData(0), fSize(0), fOwned(false)
+      {
+         int fd = ::open(fname.c_str(), O_RDONLY);
+         if (fd < 0)
+            return;
+         struct stat st;
+         if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+               fData = (char*)addr;
+               fSize = st.st_size;
+               fOwned = true;
+               setg(fData, fData, fData + fSize);
+            }
+         }
+         ::close(fd);
       }
-      else {
-        fError = "dilog constructor error - channel name collision, "
-                  "duplicated open on channel ";
-        fError += channel;
-        std::cerr << fError << std::endl;
+#endif
+
+      ~mapped_buffer() {
+#if DILOG_MMAP
+         if (fOwned)
+            munmap(fData, fSize);
+#endif
       }
-      block *bot = new block;
-      bot->chan = channel;
-      fBlocks[channel] = bot;
-      fBlock = bot;
-   }
 
-   ~dilog() {
-      static std::mutex mutex;
-      std::lock_guard<std::mutex> guard(mutex);
-      dilogs_map_t &dilogs = get_map();
-      dilogs.erase(fChannel);
-      if (fReading)
-         delete fReading;
-      if (fWriting)
-         delete fWriting;
-      if (fLogging)
-         delete fLogging;
-   }
+      bool good() const { return fData != 0; }
+      const char *data() const { return fData; }
+      size_t size() const { return fSize; }
+      const char *cur() const { return gptr(); }
+      const char *end() const { return egptr(); }
+      std::streamoff offset() const { return gptr() - eback(); }
+      void skip(size_t n) { setg(eback(), gptr() + n, egptr()); }
 
-   static dilog &get(const std::string &channel, bool threadsafe=true)
-   {
-    // This is the main factory method for dilog objects. Ownership of
-    // the object reference returned is retained by the dilog framework
-    // and returned to the user as a borrowed reference. Channel should
-    // be a unique name for this dilog channel, and becomes the filename
-    // of the dilog output file <channel>.dilog that is read in response
-    // to subsequent printf calls on this channel, or written if the
-    // file does not exist at runtime.
-    //
-    // Normally a given dilog channel should only be accessed from within
-    // the same execution thread that created it. Sometimes this rule is
-    // violated by static object cleanup running in the main thread at
-    // program exit, or some other thread locking mechanism may be in
-    // place that prevents cross-thead access violations. In that case,
-    // invoke get with threadsafe=false to suppress these unwanted
-    // errors, and take care of verifying thread safety yourself.
- 
-      static std::mutex mutex;
-      std::lock_guard<std::mutex> guard(mutex);
-      dilogs_map_t &dilogs = get_map();
-      if (dilogs.find(channel) == dilogs.end()) {
-         dilogs[channel] = new dilog(channel);
+    protected:
+      pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                       std::ios_base::openmode=std::ios_base::in)
+      {
+         off_type base = (dir == std::ios_base::beg)? 0 :
+                         (dir == std::ios_base::cur)? offset() : fSize;
+         if (base + off < 0 || base + off > (off_type)fSize)
+            return pos_type(off_type(-1));
+         setg(eback(), eback() + base + off, egptr());
+         return pos_type(base + off);
       }
-      std::thread::id tid = std::this_thread::get_id();
-      if (threadsafe && dilogs[channel]->fThread_id != tid) {
-         dilogs[channel]->fError = "dilog::get error: access to channel"
-                                   " \"" + channel + "\" attempted"
-                                   " from more than one thread";
-         std::cerr << dilogs[channel]->fError << std::endl;
+
+      pos_type seekpos(pos_type pos,
+                       std::ios_base::openmode which=std::ios_base::in)
+      {
+         return seekoff(off_type(pos), std::ios_base::beg, which);
       }
-      return *dilogs[channel];
-   }
 
-   int printf(const char* fmt, ...)
-   {
-    // This is the primary user-callable method of dilog. Normally it
-    // is invoked on a temporary reference to a dilog object returned
-    // by get, eg. dilog::get(channel).printf(...). The arguments to 
-    // printf are identical to the stdio printf function. If called
-    // with a pending error in fError from a previous failed operation,
-    // report the error again.
- 
-      if (fError.size() > 0) {
-         std::cerr << "a fatal error has occurred on channel "
-                   << fChannel << ", cannot continue." << std::endl
-                   << fError << std::endl;
-         clean_exit("dilog::printf");
+    private:
+      char *fData;
+      size_t fSize;
+      bool fOwned;                 // fData was mapped by this object
+      std::vector<char> fCopy;
+   };
+
+#if DILOG_ZLIB
+   class frame_writer : public std::streambuf {
+
+    // Output stream buffer that compresses the stream into the frames of
+    // a compressed dilog file, see DILOG_FRAME_MAGIC. A frame is written
+    // each time frame_size bytes have been collected, and on sync with
+    // whatever has been collected so far, so a flush of the stream writes
+    // out everything sent to it. The index is written at destruction.
+
+    public:
+      frame_writer(std::ofstream *out, size_t frame_size)
+       : fOut(out), fFrame(std::max(frame_size, (size_t)DILOG_FORMAT_MIN)),
+         fWritten(0), fLastlen(0)
+      {
+         fOut->write(DILOG_FRAME_MAGIC, DILOG_FRAME_HEADER);
+         setp(fFrame.data(), fFrame.data() + fFrame.size());
       }
-      const unsigned int max_message_size(99999999);
-      char *msg = new char[max_message_size];
-      std::va_list args;
+
+      ~frame_writer() {
+         write_frame();
+         for (size_t i=0; i < fCoffsets.size(); ++i) {
+            fOut->write((char*)&fCoffsets[i], sizeof(uint64_t));
+            fOut->write((char*)&fUoffsets[i], sizeof(uint64_t));
+         }
+         uint64_t nframes = fCoffsets.size();
+         fOut->write((char*)&nframes, sizeof(nframes));
+         fOut->write(DILOG_FRAME_TRAILER, DILOG_FRAME_HEADER);
+         delete fOut;
+      }
+
+      bool good() const { return fOut->good(); }
+
+    protected:
+      int_type overflow(int_type c)
+      {
+         if (!write_frame())
+            return traits_type::eof();
+         if (!traits_type::eq_int_type(c, traits_type::eof()))
+            sputc(traits_type::to_char_type(c));
+         return traits_type::not_eof(c);
+      }
+
+      int sync()
+      {
+         if (!write_frame())
+            return -1;
+         fOut->flush();
+         return (fOut->good())? 0 : -1;
+      }
+
+    private:
+      bool write_frame()
+      {
+         // Compress the bytes collected so far into the next frame.
+
+         uint32_t ulen = pptr() - pbase();
+         if (ulen == 0)
+            return true;
+         uLongf clen = compressBound(ulen);
+         fZip.resize(clen + DILOG_FRAME_HEADER);
+         if (compress2((Bytef*)&fZip[DILOG_FRAME_HEADER], &clen,
+                       (Bytef*)pbase(), ulen, Z_BEST_SPEED) != Z_OK)
+         {
+            return false;
+         }
+         uint32_t clen32 = clen;
+         memcpy(&fZip[0], &clen32, sizeof(clen32));
+         memcpy(&fZip[4], &ulen, sizeof(ulen));
+         fCoffsets.push_back(DILOG_FRAME_HEADER + fWritten);
+         fUoffsets.push_back((fUoffsets.size() > 0)?
+                             fUoffsets.back() + fLastlen : 0);
+         fOut->write(fZip.data(), clen + DILOG_FRAME_HEADER);
+         fWritten += clen + DILOG_FRAME_HEADER;
+         fLastlen = ulen;
+         setp(fFrame.data(), fFrame.data() + fFrame.size());
+         return fOut->good();
+      }
+
+      std::ofstream *fOut;
+      std::vector<char> fFrame;    // bytes of the frame being collected
+      std::vector<char> fZip;      // compressed frame being written
+      std::vector<uint64_t> fCoffsets; // file offset of each frame
+      std::vector<uint64_t> fUoffsets; // stream offset of each frame
+      uint64_t fWritten;           // bytes of frames written so far
+      uint32_t fLastlen;           // stream bytes in the last frame
+   };
+
+   class frame_ostream : public std::ostream {
+
+    // Output stream to a new compressed dilog file.
+
+    public:
+      frame_ostream(std::ofstream *out, size_t frame_size)
+       : std::ostream(0), fBuf(out, frame_size)
+      {
+         rdbuf(&fBuf);
+         if (!fBuf.good())
+            setstate(std::ios::badbit);
+      }
+
+      ~frame_ostream() {
+         flush();
+      }
+
+    private:
+      frame_writer fBuf;
+   };
+
+   class frame_reader : public std::streambuf {
+
+    // Input stream buffer over a compressed dilog file that presents the
+    // uncompressed stream, so that the readers of dilog files need not
+    // know the difference. Seeks go through the frame index to the frame
+    // holding the target offset, which is decompressed if it is not the
+    // current one. While one frame is being read, the next one is
+    // decompressed ahead of the reader on a helper thread, which has a
+    // file handle of its own.
+
+    public:
+      frame_reader(const std::string &fname)
+       : fIn(fname.c_str(), std::ios::binary), fName(fname),
+         fCurrent(npos), fEnd(false), fAheadFrame(npos), fAheadReady(false),
+         fAheadOk(false), fStop(false)
+      {
+         if (!load_index())
+            fUoffsets.clear();
+         setg(0, 0, 0);
+      }
+
+      ~frame_reader() {
+         if (fHelper.joinable()) {
+            {
+               std::lock_guard<std::mutex> lock(fMutex);
+               fStop = true;
+            }
+            fCond.notify_all();
+            fHelper.join();
+         }
+      }
+
+      bool good() const { return fUoffsets.size() > 0; }
+
+    protected:
+      int_type underflow()
+      {
+         if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+         if (fEnd)
+            return traits_type::eof();
+         size_t next = (fCurrent == npos)? 0 : fCurrent + 1;
+         for (; next < nframes(); ++next) {
+            if (!switch_to(next))
+               return traits_type::eof();
+            if (gptr() < egptr())
+               return traits_type::to_int_type(*gptr());
+         }
+         return traits_type::eof();
+      }
+
+      pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                       std::ios_base::openmode=std::ios_base::in)
+      {
+         if (!good())
+            return pos_type(off_type(-1));
+         off_type base = (dir == std::ios_base::beg)? 0 :
+                         (dir == std::ios_base::end || fEnd)?
+                         fUoffsets.back() :
+                         (fCurrent == npos)? 0 :
+                         fUoffsets[fCurrent] + (gptr() - eback());
+         off_type pos = base + off;
+         if (pos < 0 || pos > (off_type)fUoffsets.back())
+            return pos_type(off_type(-1));
+         if (pos == (off_type)fUoffsets.back()) {
+            // At the end of the stream, past the end of the last frame.
+            fEnd = true;
+            setg(0, 0, 0);
+            return pos_type(pos);
+         }
+         fEnd = false;
+         if (fCurrent == npos || pos < (off_type)fUoffsets[fCurrent] ||
+             pos >= (off_type)fUoffsets[fCurrent + 1])
+         {
+            size_t frame = std::upper_bound(fUoffsets.begin(),
+                                            fUoffsets.end(), pos)
+                           - fUoffsets.begin() - 1;
+            if (!switch_to(frame))
+               return pos_type(off_type(-1));
+         }
+         setg(fFrame.data(), fFrame.data() + (pos - fUoffsets[fCurrent]),
+              fFrame.data() + fFrame.size());
+         return pos_type(pos);
+      }
+
+      pos_type seekpos(pos_type pos,
+                       std::ios_base::openmode which=std::ios_base::in)
+      {
+         return seekoff(off_type(pos), std::ios_base::beg, which);
+      }
+
+    private:
+      static const size_t npos = (size_t)-1;
+
+      size_t nframes() const {
+         return (fUoffsets.size() > 0)? fUoffsets.size() - 1 : 0;
+      }
+
+      bool load_index()
+      {
+         // Read the frame index from the end of the file, or rebuild it
+         // from the frame headers if the file has no trailer. The stream
+         // offsets in fUoffsets end with the total size of the stream.
+
+         char magic[DILOG_FRAME_HEADER];
+         fIn.read(magic, DILOG_FRAME_HEADER);
+         if (fIn.gcount() != DILOG_FRAME_HEADER ||
+             memcmp(magic, DILOG_FRAME_MAGIC, DILOG_FRAME_HEADER) != 0)
+         {
+            return false;
+         }
+         fIn.seekg(0, std::ios::end);
+         uint64_t fsize = fIn.tellg();
+         uint64_t nframes = 0;
+         if (fsize >= 3 * DILOG_FRAME_HEADER) {
+            fIn.seekg(fsize - 2 * DILOG_FRAME_HEADER);
+            fIn.read((char*)&nframes, sizeof(nframes));
+            fIn.read(magic, DILOG_FRAME_HEADER);
+            if (memcmp(magic, DILOG_FRAME_TRAILER, DILOG_FRAME_HEADER) != 0 ||
+                nframes * 16 + 3 * DILOG_FRAME_HEADER > fsize)
+            {
+               nframes = 0;
+            }
+         }
+         if (nframes > 0) {
+            fIn.seekg(fsize - 2 * DILOG_FRAME_HEADER - nframes * 16);
+            fCoffsets.resize(nframes);
+            fUoffsets.resize(nframes + 1);
+            for (size_t i=0; i < nframes; ++i) {
+               fIn.read((char*)&fCoffsets[i], sizeof(uint64_t));
+               fIn.read((char*)&fUoffsets[i], sizeof(uint64_t));
+            }
+            uint32_t size[2];
+            fIn.seekg(fCoffsets.back());
+            fIn.read((char*)size, sizeof(size));
+            fUoffsets[nframes] = fUoffsets[nframes - 1] + size[1];
+         }
+         else {
+            uint64_t offset = DILOG_FRAME_HEADER;
+            fUoffsets.assign(1, 0);
+            fIn.clear();
+            for (uint32_t size[2];; offset += DILOG_FRAME_HEADER + size[0]) {
+               fIn.seekg(offset);
+               if (!fIn.read((char*)size, sizeof(size)) ||
+                   offset + DILOG_FRAME_HEADER + size[0] > fsize)
+               {
+                  break;
+               }
+               fCoffsets.push_back(offset);
+               fUoffsets.push_back(fUoffsets.back() + size[1]);
+            }
+         }
+         fIn.clear();
+         return fIn.good();
+      }
+
+      bool read_frame(std::ifstream &in, size_t frame, std::vector<char> &zip,
+                      std::vector<char> &out)
+      {
+         // Decompress the given frame from file in into out.
+
+         uint32_t size[2];
+         in.clear();
+         in.seekg(fCoffsets[frame]);
+         if (!in.read((char*)size, sizeof(size)) ||
+             size[1] != fUoffsets[frame + 1] - fUoffsets[frame])
+         {
+            return false;
+         }
+         zip.resize(size[0]);
+         out.resize(size[1]);
+         uLongf ulen = size[1];
+         return (in.read(zip.data(), size[0]) &&
+                 uncompress((Bytef*)out.data(), &ulen,
+                            (Bytef*)zip.data(), size[0]) == Z_OK &&
+                 ulen == size[1]);
+      }
+
+      bool switch_to(size_t frame)
+      {
+         // Make frame the current frame, taking it from the helper if it
+         // was read ahead, and ask the helper for the one after it.
+
+         bool ok = false;
+         {
+            std::unique_lock<std::mutex> lock(fMutex);
+            if (fAheadFrame != npos) {
+               fCond.wait(lock, [this]{ return fAheadReady; });
+               if (fAheadFrame == frame && fAheadOk) {
+                  fFrame.swap(fAhead);
+                  ok = true;
+               }
+               fAheadFrame = npos;
+               fAheadReady = false;
+            }
+         }
+         if (!ok && !read_frame(fIn, frame, fZip, fFrame)) {
+            fCurrent = npos;
+            setg(0, 0, 0);
+            return false;
+         }
+         fCurrent = frame;
+         setg(fFrame.data(), fFrame.data(), fFrame.data() + fFrame.size());
+         if (frame + 1 < nframes()) {
+            if (!fHelper.joinable()) {
+               fAheadIn.open(fName.c_str(), std::ios::binary);
+               fHelper = std::thread(&frame_reader::read_ahead, this);
+            }
+            std::lock_guard<std::mutex> lock(fMutex);
+            fAheadFrame = frame + 1;
+            fCond.notify_all();
+         }
+         return true;
+      }
+
+      void read_ahead()
+      {
+         // Body of the helper thread, which decompresses the frame that
+         // was last asked for into fAhead.
+
+         std::unique_lock<std::mutex> lock(fMutex);
+         while (true) {
+            fCond.wait(lock, [this]{
+               return fStop || (fAheadFrame != npos && !fAheadReady);
+            });
+            if (fStop)
+               return;
+            size_t frame = fAheadFrame;
+            lock.unlock();
+            bool ok = read_frame(fAheadIn, frame, fAheadZip, fAhead);
+            lock.lock();
+            fAheadOk = ok;
+            fAheadReady = true;
+            fCond.notify_all();
+         }
+      }
+
+      std::ifstream fIn;
+      std::ifstream fAheadIn;      // file handle of the helper thread
+      std::string fName;
+      std::vector<uint64_t> fCoffsets; // file offset of each frame
+      std::vector<uint64_t> fUoffsets; // stream offset of each frame
+      std::vector<char> fFrame;    // contents of the current frame
+      std::vector<char> fZip;      // compressed frame being read
+      size_t fCurrent;             // index of the current frame, or npos
+      bool fEnd;                   // positioned at the end of the stream
+      std::vector<char> fAhead;    // contents of the frame read ahead
+      std::vector<char> fAheadZip; // compressed frame being read ahead
+      size_t fAheadFrame;          // frame being read ahead, or npos
+      bool fAheadReady;            // fAhead holds fAheadFrame
+      bool fAheadOk;               // fAheadFrame was read without error
+      bool fStop;                  // helper thread is to exit
+      std::mutex fMutex;
+      std::condition_variable fCond;
+      std::thread fHelper;
+   };
+
+   class frame_istream : public std::istream {
+
+    // Input stream from a compressed dilog file.
+
+    public:
+      frame_istream(const std::string &fname)
+       : std::istream(0), fBuf(fname)
+      {
+         rdbuf(&fBuf);
+         if (!fBuf.good())
+            setstate(std::ios::badbit);
+      }
+
+    private:
+      frame_reader fBuf;
+   };
+#endif
+
+   static bool is_compressed(const std::string &fname)
+   {
+    // Check whether file fname is a compressed dilog file.
+
+      char magic[DILOG_FRAME_HEADER];
+      std::ifstream in(fname.c_str(), std::ios::binary);
+      in.read(magic, DILOG_FRAME_HEADER);
+      return (in.gcount() == DILOG_FRAME_HEADER &&
+              memcmp(magic, DILOG_FRAME_MAGIC, DILOG_FRAME_HEADER) == 0);
+   }
+
+   static std::istream *open_file(const std::string &fname)
+   {
+    // Open dilog file fname for sequential reading, decompressing it if
+    // it is compressed, and return the stream, or null on failure.
+ 
+      if (is_compressed(fname)) {
+#if DILOG_ZLIB
+         std::istream *in = new frame_istream(fname);
+         if (in->good())
+            return in;
+         delete in;
+#else
+         std::cerr << "dilog error - file " << fname << " is compressed,"
+                   << " but dilog was built without DILOG_ZLIB" << std::endl;
+#endif
+         return 0;
+      }
+      std::ifstream *in = new std::ifstream(fname.c_str(), std::ios::binary);
+      if (in->good())
+         return in;
+      delete in;
+      return 0;
+   }
+
+   class container {
+
+    // A container holds the streams of any number of channels in one
+    // data file <name>c, as a sequence of chunks, each one a contiguous
+    // piece of the stream of one channel. The chunks are listed in the
+    // order they were written in the directory file <name>d, one line
+    // per chunk giving its offset in the data file, its size, and the
+    // channel name. Here name is <options().container>.dilog for the
+    // recorded streams, or the same with .dilog2 for check mode logs.
+    // Only the container keeps files open, so any number of channels
+    // can be open at once, see options().container.
+
+    public:
+      container(const std::string &name, bool reading)
+       : fName(name), fData(0), fOffset(0)
+      {
+         // Open container name, loading its directory if reading,
+         // or else truncating it at the first append.
+ 
+         if (!reading) {
+            fOut.open((fName + "c").c_str(),
+                      std::ios::out | std::ios::binary | std::ios::trunc);
+            fDir.open((fName + "d").c_str(), std::ios::out | std::ios::trunc);
+            return;
+         }
+         std::ifstream dir((fName + "d").c_str());
+         std::string line;
+         while (std::getline(dir, line)) {
+            std::istringstream fields(line);
+            uint64_t offset, size;
+            std::string channel;
+            if (fields >> offset >> size && fields.get() == ' ' &&
+                std::getline(fields, channel))
+            {
+               fChunks[channel].push_back(std::make_pair(offset, size));
+               fOffset = std::max(fOffset, offset + size);
+            }
+         }
+#if DILOG_MMAP
+         if (options().map_input && fChunks.size() > 0) {
+            fData = new mapped_buffer(fName + "c");
+            if (!fData->good()) {
+               delete fData;
+               fData = 0;
+            }
+         }
+#endif
+         fIn.open((fName + "c").c_str(), std::ios::binary);
+      }
+
+      ~container() {
+         if (fData)
+            delete fData;
+      }
+
+      mapped_buffer *open(const std::string &channel)
+      {
+         // Return a new stream buffer over the recorded stream of
+         // channel, or null if the container does not have it. A stream
+         // held in a single chunk of a memory-mapped container is read
+         // in place, otherwise it is read into memory.
+ 
+         std::lock_guard<std::mutex> guard(fMutex);
+         auto citer = fChunks.find(channel);
+         if (citer == fChunks.end())
+            return 0;
+         const std::vector<std::pair<uint64_t, uint64_t> > &chunks =
+                                                        citer->second;
+         if (fData && chunks.size() == 1 &&
+             chunks[0].first + chunks[0].second <= (uint64_t)fData->size())
+         {
+            return new mapped_buffer(fData->data() + chunks[0].first,
+                                     chunks[0].second);
+         }
+         std::vector<char> stream;
+         for (auto &chunk : chunks) {
+            size_t start = stream.size();
+            stream.resize(start + chunk.second);
+            fIn.clear();
+            fIn.seekg(chunk.first);
+            if (!fIn.read(stream.data() + start, chunk.second))
+               return 0;
+         }
+         return new mapped_buffer(stream);
+      }
+
+      void append(const std::string &channel, const char *data, size_t len)
+      {
+         // Write a new chunk of len bytes at data to the stream of
+         // channel, opening the container for append if necessary.
+ 
+         if (len == 0)
+            return;
+         std::lock_guard<std::mutex> guard(fMutex);
+         if (!fOut.is_open()) {
+            fOut.open((fName + "c").c_str(),
+                      std::ios::out | std::ios::binary | std::ios::app);
+            fDir.open((fName + "d").c_str(), std::ios::out | std::ios::app);
+            fOut.seekp(0, std::ios::end);
+            fOffset = fOut.tellp();
+         }
+         fOut.write(data, len);
+         fOut.flush();
+         fDir << fOffset << " " << len << " " << channel << std::endl;
+         fOffset += len;
+      }
+
+    private:
+      std::string fName;
+      std::map<std::string, std::vector<std::pair<uint64_t, uint64_t> > >
+                                                                fChunks;
+      mapped_buffer *fData;        // mapped data file, if reading
+      std::ifstream fIn;           // data file, if reading and not mapped
+      std::ofstream fOut;          // data file, opened at first append
+      std::ofstream fDir;          // directory file, same
+      uint64_t fOffset;            // size of the data file
+      std::mutex fMutex;
+   };
+
+   class container_stream : public std::ostream {
+
+    // Output stream for one channel into a container. Output collects
+    // in a chunk buffer, which is appended to the container whenever it
+    // fills up, and when the stream is flushed or destroyed. The chunk
+    // is options().write_buffer bytes, but no less than DILOG_CHUNK_SIZE,
+    // so that the container is not locked for every few lines.
+
+    public:
+      container_stream(container &store, const std::string &channel)
+       : std::ostream(&fBuf), fBuf(store, channel)
+      {}
+
+      ~container_stream() {
+         fBuf.pubsync();
+      }
+
+    private:
+      class chunk_buffer : public std::streambuf {
+       public:
+         chunk_buffer(container &store, const std::string &channel)
+          : fStore(store), fChannel(channel),
+            fChunk(std::max(options().write_buffer,
+                            (size_t)DILOG_CHUNK_SIZE))
+         {
+            setp(fChunk.data(), fChunk.data() + fChunk.size());
+         }
+
+       protected:
+         int_type overflow(int_type c)
+         {
+            sync();
+            if (c != traits_type::eof()) {
+               *pptr() = c;
+               pbump(1);
+            }
+            return traits_type::not_eof(c);
+         }
+
+         int sync()
+         {
+            fStore.append(fChannel, pbase(), pptr() - pbase());
+            setp(fChunk.data(), fChunk.data() + fChunk.size());
+            return 0;
+         }
+
+       private:
+         container &fStore;
+         std::string fChannel;
+         std::vector<char> fChunk;
+      };
+
+      chunk_buffer fBuf;
+   };
+
+   class async_writer;
+   class async_buffer : public std::streambuf {
+
+    // Output stream buffer for a record-mode channel in async mode. The
+    // channel writes its output into the free part of a fixed ring, and
+    // publishes it to the background writer at each flush, or whenever
+    // the free space runs out. The ring is single-producer, single-
+    // consumer: only the channel writes into it, and only one drain()
+    // at a time copies published output from it into the sink stream.
+    // When the ring is full, the producer waits for the writer to
+    // catch up, so memory use is bounded by the size of the ring.
+
+    public:
+      async_buffer(std::ostream *sink, size_t size, bool buffered,
+                   async_writer &writer)
+       : fRing(std::max(size, (size_t)DILOG_FORMAT_MIN)),
+         fHead(0), fTail(0), fSink(sink), fBuffered(buffered),
+         fWriter(writer)
+      {
+         reserve();
+      }
+
+      ~async_buffer() {
+         delete fSink;
+      }
+
+      bool drain(bool wait=true)
+      {
+         // Copy all published output into the sink stream, and flush
+         // it unless buffered. If wait is false, give up and return false
+         // if another drain is already in progress, as must be done from
+         // inside a signal handler.
+ 
+         std::unique_lock<std::mutex> lock(fDrain, std::defer_lock);
+         if (wait)
+            lock.lock();
+         else if (!lock.try_lock())
+            return false;
+         size_t tail = fTail.load(std::memory_order_relaxed);
+         size_t head = fHead.load(std::memory_order_acquire);
+         if (tail == head)
+            return true;
+         while (tail < head) {
+            size_t start = tail % fRing.size();
+            size_t len = std::min(head - tail, fRing.size() - start);
+            fSink->write(&fRing[start], len);
+            tail += len;
+         }
+         fTail.store(tail, std::memory_order_release);
+         if (!fBuffered)
+            fSink->flush();
+         return true;
+      }
+
+      size_t pending() const {
+         return fHead.load(std::memory_order_relaxed) -
+                fTail.load(std::memory_order_relaxed);
+      }
+
+      size_t size() const { return fRing.size(); }
+
+    protected:
+      int_type overflow(int_type c)
+      {
+         publish();
+         while (!reserve()) {
+            fWriter.notify();
+            std::this_thread::yield();
+         }
+         if (c != traits_type::eof()) {
+            *pptr() = c;
+            pbump(1);
+         }
+         return traits_type::not_eof(c);
+      }
+
+      int sync()
+      {
+         publish();
+         reserve();
+         if (pending() > fRing.size() / 2)
+            fWriter.notify();
+         return 0;
+      }
+
+      void publish()
+      {
+         size_t len = pptr() - pbase();
+         fHead.store(fHead.load(std::memory_order_relaxed) + len,
+                     std::memory_order_release);
+         setp(pptr(), pptr());
+      }
+
+      bool reserve()
+      {
+         // Make the largest contiguous free region of the ring following
+         // the published output available as the put area, and return
+         // false if the ring is full.
+ 
+         size_t head = fHead.load(std::memory_order_relaxed);
+         size_t tail = fTail.load(std::memory_order_acquire);
+         size_t start = head % fRing.size();
+         size_t len = std::min(fRing.size() - (head - tail),
+                               fRing.size() - start);
+         setp(&fRing[start], &fRing[start] + len);
+         return (len > 0);
+      }
+
+    private:
+      std::vector<char> fRing;
+      std::atomic<size_t> fHead;   // total bytes published by the channel
+      std::atomic<size_t> fTail;   // total bytes drained into the sink
+      std::mutex fDrain;           // held by drain while it runs
+      std::ostream *fSink;
+      bool fBuffered;
+      async_writer &fWriter;
+   };
+
+   class async_writer {
+
+    // Background thread shared by all channels in async mode, which
+    // wakes up every few milliseconds, or when a channel is running
+    // out of ring space, to drain their rings into the output files.
+    // It is owned by the dilogs_holder, and stopped only after all
+    // of the channels have been destroyed.
+
+    public:
+      async_writer()
+       : fStop(false), fThread(&async_writer::run, this)
+      {}
+
+      ~async_writer() {
+         {
+            std::lock_guard<std::mutex> guard(fMutex);
+            fStop = true;
+         }
+         fWake.notify_one();
+         fThread.join();
+      }
+
+      void attach(async_buffer *buf) {
+         std::lock_guard<std::mutex> guard(fMutex);
+         fBuffers.push_back(buf);
+      }
+
+      void detach(async_buffer *buf) {
+         std::lock_guard<std::mutex> guard(fMutex);
+         fBuffers.erase(std::remove(fBuffers.begin(), fBuffers.end(), buf),
+                        fBuffers.end());
+      }
+
+      void notify() {
+         fWake.notify_one();
+      }
+
+    private:
+      void run() {
+         std::unique_lock<std::mutex> lock(fMutex);
+         while (!fStop) {
+            for (auto buf : fBuffers)
+               buf->drain();
+            fWake.wait_for(lock, std::chrono::milliseconds(10));
+         }
+         for (auto buf : fBuffers)
+            buf->drain();
+      }
+
+      std::vector<async_buffer*> fBuffers;
+      std::mutex fMutex;
+      std::condition_variable fWake;
+      bool fStop;
+      std::thread fThread;
+   };
+
+   dilog(const std::string& channel)
+    : fLineno(0), fChannel(channel), fReplay(0),
+      fLineIndex(1, 0), fLineBase(0), fIndexLoaded(false),
+      fBuffered(options().write_buffer > 0 || options().container.size() > 0
+                || options().compress_output),
+      fBinary(false), fLastlen(0), fPrescan(0), fMapped(0),
+      fContained(options().container.size() > 0), fPendingBlock(0),
+      fPendingLine(0),
+      fDigesting(0), fDigest(0), fAsync(0),
+      fRecordLimit(options().replay_window), fSkipping(0),
+      fTask(0), fFile(file_stem(channel)), fInput(fFile), fCheckpoints(0),
+      fCheckpointPaths(0), fResuming(false), fStopped(false), fLastLine(-1),
+      fActual(false), fUnsettled(false),
+      fCached(std::make_shared<std::atomic<bool> >(true))
+   {
+      if (options().gather_dir.size() > 0 && !fContained &&
+          !file_exists(fFile + ".dilog"))
+      {
+         // The recorded files of an earlier run may have been gathered.
+         if (file_exists(gather_stem() + ".dilog"))
+            fInput = gather_stem();
+      }
+      std::string fname(fInput + ".dilog");
+      if (options().abort_file.size() > 0) {
+         static std::mutex mutex;
+         std::lock_guard<std::mutex> guard(mutex);
+         watcher().start();
+      }
+#if !DILOG_ZLIB
+      if (options().compress_output)
+         fError = "dilog constructor error - compress_output was set,"
+                  " but dilog was built without DILOG_ZLIB";
+#endif
+      if (options().max_channels > 0 &&
+          get_map().size() >= options().max_channels)
+      {
+         // New channels are only created by get, with get_lock() held.
+         fReading = 0;
+         fWriting = 0;
+         fLogging = 0;
+         fError = "dilog constructor error - opening channel " + channel +
+                  " would go over the limit of " +
+                  std::to_string(options().max_channels) + " open channels"
+                  " set by options().max_channels, release channels once"
+                  " they are done with, this is a fatal error.";
+         std::cerr << fError << std::endl;
+      }
+      else if (options().sample_channels > 1 &&
+               key_hash(0, channel.data(), channel.size()) %
+          options().sample_channels != 0)
+      {
+         // A channel that is not sampled has no files, and all of its
+         // messages and blocks are skipped.
+         fReading = 0;
+         fWriting = 0;
+         fLogging = 0;
+         fSkipping = 1;
+      }
+      else if (options().multi_process && process_tag().size() == 0) {
+         // Without a tag that is the same from one run to the next, the
+         // files of one process cannot be told from those of another.
+         fReading = 0;
+         fWriting = 0;
+         fLogging = 0;
+         fError = "dilog constructor error - multi_process was set, but no"
+                  " MPI rank was found in the environment, set"
+                  " options().process_tag instead, this is a fatal error.";
+         std::cerr << fError << std::endl;
+      }
+      else if ((fReading = open_input(fname))) {
+         fWriting = 0;
+         fBinary = is_binary(*fReading);
+         if (fBinary)
+            fLineIndex[0] = DILOG_BINARY_HEADER;
+         if (options().save_index && !fContained)
+            fIndexLoaded = load_index();
+         seek_line(0);
+         if ((options().resume_at.size() > 0 ||
+              options().stop_at.size() > 0) && !fContained)
+         {
+            load_checkpoints();
+            if (fMarks.count(options().resume_at)) {
+               fResuming = true;
+               fSkipping = 1;
+            }
+            auto cp = fMarks.find(options().stop_at);
+            if (cp != fMarks.end())
+               fLastLine = cp->second.lineno;
+         }
+         // The prescan covers the whole file, so it is not used when the
+         // check ends at a checkpoint.
+         if (options().prescan_blocks && options().index_blocks &&
+             !fContained && fLastLine == (unsigned int)-1)
+         {
+            fPrescan = new set_scanner(fname, fBinary);
+         }
+         fLogging = open_output(fFile + ".dilog2");
+         if (!fLogging->good()) {
+            fError = "dilog constructor error - unable to open "
+                     "output dilog2 file, this is a fatal error.";
+         }
+      }
+      else if (options().gather_dir.size() > 0 && !fContained &&
+               (file_exists(gather_stem() + ".dilog2") ||
+                file_exists(gather_stem() + ".dilogk") ||
+                file_exists(gather_stem() + ".dilogx")))
+      {
+         // Other files of the channel were gathered by an earlier run, so
+         // the recorded file is missing, and recording a new one here
+         // would hide that.
+         fReading = 0;
+         fWriting = 0;
+         fLogging = 0;
+         fError = "dilog constructor error - recorded file " + fname +
+                  " not found, although " + options().gather_dir +
+                  " holds other files of channel " + channel +
+                  ", this is a fatal error.";
+         std::cerr << fError << std::endl;
+      }
+      else {
+         fLogging = 0;
+         fWriting = open_output(fname);
+         if (!fWriting->good()) {
+            fError = "dilog constructor error - unable to open "
+                     "output dilog file, this is a fatal error.";
+         }
+         else {
+            if (options().async_write) {
+               fAsync = new async_buffer(fWriting, options().async_buffer,
+                                         fBuffered, get_writer());
+               fWriting = new std::ostream(fAsync);
+               get_writer().attach(fAsync);
+            }
+            if (options().binary_format) {
+               fBinary = true;
+               fWriting->write(DILOG_BINARY_MAGIC, DILOG_BINARY_HEADER);
+               fStats.bytes_written += DILOG_BINARY_HEADER;
+            }
+         }
+      }
+      // New channels are only created by get, with get_lock() held.
+      dilogs_map_t &dilogs = get_map();
+      std::thread::id tid = std::this_thread::get_id();
+      if (dilogs.find(channel) == dilogs.end()) {
+         dilogs[channel] = this;
+         fThread_id = tid;
+      }
+      else {
+        fError = "dilog constructor error - channel name collision, "
+                  "duplicated open on channel ";
+        fError += channel;
+        std::cerr << fError << std::endl;
+      }
+      block *bot = new block;
+      bot->chan = channel;
+      bot->setPath(*this);
+      fNodes[bot->pathid].current = bot;
+      fBlock = bot;
+   }
+
+   ~dilog() {
+      task_context *task = fTask.load(std::memory_order_acquire);
+      if (task)
+         task->unbind(this);
+      bool checking = (fReading != 0);
+      bool open = (checking || fWriting != 0);
+      if (fAsync) {
+         fWriting->flush();
+         get_writer().detach(fAsync);
+         fAsync->drain();
+         delete fWriting;
+         delete fAsync;
+         fWriting = 0;
+         fAsync = 0;
+      }
+      if (fReading)
+         delete fReading;
+      if (fMapped)
+         delete fMapped;
+      if (fPrescan)
+         delete fPrescan;
+      if (fCheckpoints)
+         delete fCheckpoints;
+      if (fWriting)
+         delete fWriting;
+      if (fLogging)
+         delete fLogging;
+      fReading = 0;
+      fWriting = 0;
+      fLogging = 0;
+      if (options().save_index && !fIndexLoaded && !fContained && open)
+         save_index();
+      if (options().gather_dir.size() > 0 && !fContained && open)
+         gather(checking);
+      for (auto &node : fNodes) {
+         if (node.current && node.current->owned) {
+            node.current->parent = 0;
+            delete node.current;
+         }
+      }
+      // Channels are taken out of the map by release before
+      // they are deleted, and only remain in it at exit, so no channel
+      // may be deleted with get_lock() held.
+      std::lock_guard<std::mutex> guard(get_lock());
+      dilogs_map_t &dilogs = get_map();
+      auto diter = dilogs.find(fChannel);
+      if (diter != dilogs.end() && diter->second == this)
+         dilogs.erase(diter);
+      get_holder().fStats[fChannel].add(fStats);
+   }
+
+   static dilog &get(const std::string &channel, bool threadsafe=true)
+   {
+    // This is the main factory method for dilog objects. Ownership of
+    // the object reference returned is retained by the dilog framework
+    // and returned to the user as a borrowed reference. Channel should
+    // be a unique name for this dilog channel, and becomes the filename
+    // of the dilog output file <channel>.dilog that is read in response
+    // to subsequent printf calls on this channel, or written if the
+    // file does not exist at runtime.
+    //
+    // Normally a given dilog channel should only be accessed from within
+    // the same execution thread that created it. Sometimes this rule is
+    // violated by static object cleanup running in the main thread at
+    // program exit, or some other thread locking mechanism may be in
+    // place that prevents cross-thead access violations. In that case,
+    // invoke get with threadsafe=false to suppress these unwanted
+    // errors, and take care of verifying thread safety yourself.
+    //
+    // Channels are remembered in a thread-local cache by the thread that
+    // owns them, so repeated lookups from the owning thread are resolved
+    // without taking the global lock. Only the owning thread ever finds
+    // a channel in its cache, so the thread ownership check is only
+    // needed on the uncached path. A channel that belongs to a
+    // task_context is owned by whichever thread the task is attached
+    // to, and is only taken from the cache while it is attached there.
+    // Each cache entry holds the validity flag of its channel, which is
+    // cleared when the channel is released, see invalidate_caches, so
+    // that releasing one channel leaves the rest of the cache intact.
+ 
+      thread_cache &cache = get_cache();
+      const cache_entry *last = cache.last;
+      if (last && last->valid->load(std::memory_order_acquire) &&
+          last->dlog->fChannel == channel && last->dlog->task_here())
+      {
+         return *last->dlog;
+      }
+      auto citer = cache.table.find(channel);
+      if (citer != cache.table.end()) {
+         const cache_entry &entry = citer->second;
+         if (!entry.valid->load(std::memory_order_acquire)) {
+            if (cache.last == &entry)
+               cache.last = 0;
+            cache.table.erase(citer);
+         }
+         else if (entry.dlog->task_here()) {
+            cache.last = &entry;
+            return *entry.dlog;
+         }
+      }
+      std::lock_guard<std::mutex> guard(get_lock());
+      dilogs_map_t &dilogs = get_map();
+      if (dilogs.find(channel) == dilogs.end()) {
+         dilog *dlog = new dilog(channel);
+         dilogs[channel] = dlog;
+         if (get_holder().fReleased.count(channel)) {
+            dlog->fError = "dilog::get error: channel \"" + channel + "\""
+                           " was opened again after it was released";
+            std::cerr << dlog->fError << std::endl;
+         }
+      }
+      dilog *dlog = dilogs[channel];
+      if (dlog->owned_here()) {
+         if (cache.table.size() >= cache.limit)
+            cache.prune();
+         cache_entry &entry = cache.table[channel];
+         entry.dlog = dlog;
+         entry.valid = dlog->fCached;
+         cache.last = &entry;
+      }
+      else if (threadsafe) {
+         dlog->fError = "dilog::get error: access to channel"
+                        " \"" + channel + "\" attempted"
+                        " from more than one thread";
+         std::cerr << dlog->fError << std::endl;
+      }
+      return *dlog;
+   }
+
+   class channel {
+
+    // Lightweight handle to a dilog channel returned by dilog::open,
+    // which can be held by the caller to avoid repeated lookups of the
+    // channel by name. Unless it was opened with threadsafe=false, the
+    // handle checks that it is being used from the thread that owns
+    // the channel.
+
+    public:
+      channel() : fDilog(0), fThreadsafe(true) {}
+      channel(dilog &dlog, bool threadsafe=true)
+       : fDilog(&dlog), fThreadsafe(threadsafe)
+      {}
+
+      int printf(const char* fmt, ...)
+      {
+         std::va_list args;
+         va_start(args, fmt);
+         int bytes = get().vprintf(fmt, args);
+         va_end(args);
+         return bytes;
+      }
+
+      template <typename... Args>
+      int log(const Args&... args)
+      {
+         return get().log(args...);
+      }
+
+      dilog &get() const {
+         if (fThreadsafe && !fDilog->owned_here()) {
+            fDilog->fError = "dilog::channel error: access to channel"
+                             " \"" + fDilog->fChannel + "\" attempted"
+                             " from more than one thread";
+            std::cerr << fDilog->fError << std::endl;
+         }
+         return *fDilog;
+      }
+
+      dilog &operator*() const { return get(); }
+      dilog *operator->() const { return &get(); }
+      operator bool() const { return fDilog != 0; }
+
+    private:
+      dilog *fDilog;
+      bool fThreadsafe;
+   };
+
+   static channel open(const std::string &name, bool threadsafe=true)
+   {
+    // Return a handle to the dilog channel with the given name, opening
+    // it first if needed, as for dilog::get.
+ 
+      return channel(get(name, threadsafe), threadsafe);
+   }
+
+   static void release(const std::string &name)
+   {
+    // Close the dilog channel with the given name and free all of its
+    // resources, once the application is done with it. This checks that
+    // the channel is not inside any block, and in check mode that the
+    // whole recorded stream has been matched, reporting a fatal error
+    // otherwise, so a channel should not be released while it is still
+    // in use. Any handles to the channel are invalid afterwards, and it
+    // cannot be opened again by this process.
+ 
+      dilog *dlog;
+      {
+         std::lock_guard<std::mutex> guard(get_lock());
+         dilogs_map_t &dilogs = get_map();
+         auto diter = dilogs.find(name);
+         if (diter == dilogs.end())
+            return;
+         dlog = diter->second;
+      }
+      dlog->finish();
+      {
+         std::lock_guard<std::mutex> guard(get_lock());
+         dilogs_map_t &dilogs = get_map();
+         auto diter = dilogs.find(name);
+         if (diter == dilogs.end() || diter->second != dlog)
+            return;
+         get_holder().fReleased.insert(name);
+         dilogs.erase(diter);
+         dlog->invalidate_caches();
+      }
+      delete dlog;
+   }
+
+   class scope : public channel {
+
+    // Handle to a dilog channel that releases the channel when it goes
+    // out of scope, eg. for a channel used for one event of a segmented
+    // application, see dilog::release.
+    //
+    //    dilog::scope event("event_" + std::to_string(ievent));
+    //    event.printf("processing event %d\n", ievent);
+
+    public:
+      scope(const std::string &name, bool threadsafe=true)
+       : channel(dilog::get(name, threadsafe), threadsafe), fName(name)
+      {}
+
+      ~scope() {
+         release(fName);
+      }
+
+    private:
+      scope(const scope &) = delete;
+      scope &operator=(const scope &) = delete;
+      std::string fName;
+   };
+
+   class task_context {
+
+    // Owner of the dilog channels of a logical task that can move from
+    // one thread to another, as in task-based executors that steal work.
+    // Channels opened through a task_context belong to the task instead
+    // of to a thread, and the thread ownership checks made by dilog::get
+    // and dilog::channel follow the task from thread to thread, so they
+    // need not be turned off with threadsafe=false. A task starts out
+    // attached to the thread that creates it, and is handed over by a
+    // call to detach on the old thread before it is suspended, and to
+    // attach on the thread where it resumes.
+    //
+    //    dilog::task_context task;
+    //    dilog::channel chan = task.open("event_" + std::to_string(ievent));
+    //    ...
+    //    task.detach();
+    //    ... task resumes on another worker thread ...
+    //    task.attach();
+    //    chan.printf("processing event %d\n", ievent);
+    //
+    // Attaching a task that is still attached to another thread, and
+    // using its channels from any thread it is not attached to are fatal
+    // errors on its channels, as for dilog::get. Ownership is held in one
+    // atomic token, whose handoff also makes the updates to the channels
+    // made before detach visible to the thread that attaches next. The
+    // task must outlive its use of the channels, which go back to being
+    // owned by the thread that destroys it.
+
+    public:
+      task_context() : fOwner(thread_token()) {}
+
+      ~task_context() {
+         // The channels are taken out of the caches of the threads that
+         // had them before, so that only the new owner finds them there.
+         std::lock_guard<std::mutex> guard(get_lock());
+         for (dilog *dlog : fChannels) {
+            dlog->fTask.store(0, std::memory_order_release);
+            dlog->fThread_id = std::this_thread::get_id();
+            dlog->invalidate_caches();
+         }
+      }
+
+      channel open(const std::string &name)
+      {
+         // Open the named channel, as for dilog::open, and hand it over
+         // to this task, which must be attached to the calling thread.
+         // The channel must be new or else owned by the calling thread.
+ 
+         dilog &dlog = dilog::get(name, false);
+         task_context *task = dlog.fTask.load(std::memory_order_acquire);
+         if (task != this) {
+            if (!attached() || !dlog.owned_here()) {
+               dlog.fError = "dilog::task_context::open error: channel"
+                             " \"" + name + "\" was opened by a task"
+                             " that is not attached to the thread"
+                             " that owns it";
+               std::cerr << dlog.fError << std::endl;
+               return channel(dlog);
+            }
+            if (task)
+               task->unbind(&dlog);
+            dlog.fTask.store(this, std::memory_order_release);
+            fChannels.push_back(&dlog);
+         }
+         return channel(dlog);
+      }
+
+      void attach()
+      {
+         // Attach this task to the calling thread.
+ 
+         uint64_t none = 0;
+         if (!fOwner.compare_exchange_strong(none, thread_token(),
+                                             std::memory_order_acquire) &&
+             none != thread_token())
+         {
+            fail("dilog::task_context::attach error: task is still"
+                 " attached to another thread");
+         }
+      }
+
+      void detach()
+      {
+         // Detach this task from the calling thread.
+ 
+         uint64_t self = thread_token();
+         if (!fOwner.compare_exchange_strong(self, 0,
+                                             std::memory_order_release))
+         {
+            fail("dilog::task_context::detach error: task is not"
+                 " attached to this thread");
+         }
+      }
+
+      bool attached() const {
+         return fOwner.load(std::memory_order_acquire) == thread_token();
+      }
+
+    private:
+      task_context(const task_context &) = delete;
+      task_context &operator=(const task_context &) = delete;
+
+      void unbind(dilog *dlog)
+      {
+         // Forget a channel that is being released or handed over.
+         auto iter = std::find(fChannels.begin(), fChannels.end(), dlog);
+         if (iter != fChannels.end())
+            fChannels.erase(iter);
+      }
+
+      void fail(const std::string &error)
+      {
+         std::cerr << error << std::endl;
+         for (dilog *dlog : fChannels)
+            dlog->fError = error;
+      }
+
+      std::atomic<uint64_t> fOwner;    // thread_token of owner, or 0
+      std::vector<dilog*> fChannels;   // channels that belong to the task
+
+      friend class dilog;
+   };
+
+   int printf(const char* fmt, ...)
+   {
+    // This is the primary user-callable method of dilog. Normally it
+    // is invoked on a temporary reference to a dilog object returned
+    // by get, eg. dilog::get(channel).printf(...). The arguments to 
+    // printf are identical to the stdio printf function. If called
+    // with a pending error in fError from a previous failed operation,
+    // report the error again.
+ 
+      std::va_list args;
       va_start(args, fmt);
-      int bytes = vsnprintf(msg, max_message_size, fmt, args);
+      int bytes = vprintf(fmt, args);
       va_end(args);
-      char *eos = strchr(msg, '\n');
+      return bytes;
+   }
+
+   int vprintf(const char* fmt, std::va_list args)
+   {
+    // Same as printf, with the arguments passed as a va_list.
+ 
+      if (fSkipping)
+         return 0;
+      timer clock(fStats.printf_ns);
+      ++fStats.messages;
+      settle_actual();
+      stop_if_aborted("dilog::printf");
+      if (fError.size() > 0) {
+         std::cerr << "a fatal error has occurred on channel "
+                   << fChannel << ", cannot continue." << std::endl
+                   << fError << std::endl;
+         clean_exit("dilog::printf");
+      }
+      // Format the message directly into the channel's reusable buffer
+      // fFormat, behind a "[<block path>]" prefix that is laid down in
+      // place, so that the buffer holds the complete dilog line. The
+      // buffer only grows when a message arrives that does not fit.
+      const std::string &path = fBlock->getPath();
+      size_t head = path.size() + 2;
+      if (fFormat.size() < head + DILOG_FORMAT_MIN)
+         fFormat.resize(head + DILOG_FORMAT_MIN);
+      fFormat[0] = '[';
+      memcpy(&fFormat[1], path.data(), path.size());
+      fFormat[head - 1] = ']';
+      std::va_list args2;
+      va_copy(args2, args);
+      int bytes = vsnprintf(&fFormat[head], fFormat.size() - head, fmt, args);
+      if (bytes >= (int)(fFormat.size() - head)) {
+         fFormat.resize(head + bytes + 1);
+         vsnprintf(&fFormat[head], fFormat.size() - head, fmt, args2);
+      }
+      va_end(args2);
+      send_line(head, (bytes > 0)? bytes : 0);
+      return bytes;
+   }
+
+   template <typename... Args>
+   int log(const Args&... args)
+   {
+    // Type-safe alternative to printf, which sends the message made up
+    // of the text form of each of its arguments, separated by spaces.
+    // The arguments are converted according to their type, without a
+    // format string to parse, so that eg.
+    //
+    //    dilog::get("sheepcounter").log("looking at sheep", isheep,
+    //                                   "in herd", herd);
+    //
+    // sends the same line as printf("looking at sheep %d in herd %s\n",
+    // isheep, herd). Strings and characters are copied as they are,
+    // bools become true or false, integers are written in decimal, and
+    // floating point numbers with as many significant digits as it takes
+    // to tell any two values apart, as by printf format %.9g for float
+    // and %.17g for double. Arguments of any other type, pointers
+    // included, are rejected at compile time. Returns the length of the
+    // message.
+ 
+      if (fSkipping)
+         return 0;
+      timer clock(fStats.printf_ns);
+      ++fStats.messages;
+      settle_actual();
+      stop_if_aborted("dilog::log");
+      if (fError.size() > 0) {
+         std::cerr << "a fatal error has occurred on channel "
+                   << fChannel << ", cannot continue." << std::endl
+                   << fError << std::endl;
+         clean_exit("dilog::log");
+      }
+      const std::string &path = fBlock->getPath();
+      size_t head = path.size() + 2;
+      if (fFormat.size() < head + DILOG_FORMAT_MIN)
+         fFormat.resize(head + DILOG_FORMAT_MIN);
+      fFormat[0] = '[';
+      memcpy(&fFormat[1], path.data(), path.size());
+      fFormat[head - 1] = ']';
+      size_t pos = head;
+      log_fields(pos, args...);
+      send_line(head, pos - head);
+      return pos - head;
+   }
+
+   int get_lineno() const {
+      return fLineno;
+   }
+
+   void set_tolerance(unsigned int ulps, double rel=0)
+   {
+    // Let the floating point numbers in the messages of this channel
+    // differ from those recorded by up to ulps units in the last place,
+    // or by up to rel times their magnitude, in check mode. A message
+    // that does not match its recorded line exactly is then compared
+    // field by field, and it still matches if all of its text is the
+    // same apart from numbers that agree within the tolerance, where at
+    // least one of the two is written with a decimal point or exponent,
+    // as %g writes 3.0 as "3". Two integers are always compared exactly,
+    // as are all messages by default or with a tolerance of 0.
+    // See also block::set_tolerance.
+ 
+      fTolerance[fChannel] = tolerance_t(ulps, rel);
+   }
+
+   void checkpoint(const std::string &marker)
+   {
+    // Mark a checkpoint on this channel under the given marker, eg. the
+    // number of the event about to be processed, outside of any block.
+    // In record mode, the position reached in the output is saved under
+    // marker in <channel>.dilogk. In check mode, with options().resume_at
+    // set to a saved marker, all messages and blocks are skipped until
+    // the checkpoint with that marker, and the check then starts from
+    // the position that was saved for it. With options().stop_at set,
+    // the check ends at the checkpoint with that marker, which must be
+    // reached at the saved position, and the rest of the channel is
+    // skipped. This way a long run can be checked in segments, see the
+    // dilogbisect utility. Markers need not be unique, the first
+    // checkpoint saved under a marker is the one that counts.
+ 
+      settle_actual();
+      if (fError.size() > 0)
+         clean_exit("dilog::checkpoint");
+      if ((!fReading && !fWriting) || fContained || fActual)
+         return;
+      if (fBlock->parent != 0 || fSkipping > (fResuming || fStopped)) {
+         fError = "dilog::checkpoint error: checkpoint " + marker +
+                  " taken inside an open block on channel " + fChannel;
+         clean_exit("dilog::checkpoint");
+      }
+      if (fWriting) {
+         save_checkpoint(marker);
+         return;
+      }
+      auto cp = fMarks.find(marker);
+      if (cp == fMarks.end())
+         return;
+      if (fResuming && marker == options().resume_at) {
+         resume(cp->second);
+      }
+      else if (!fResuming && !fStopped && marker == options().stop_at) {
+         if (fLineno != cp->second.lineno) {
+            fError = "dilog::checkpoint error: expected checkpoint " +
+                     marker + " at line " +
+                     std::to_string(cp->second.lineno) + " in " + fInput +
+                     ".dilog but the check reached line " +
+                     std::to_string(fLineno);
+            clean_exit("dilog::checkpoint");
+         }
+         fStopped = true;
+         fSkipping = 1;
+         flush();
+      }
+   }
+
+   struct options_t {
+
+    // Process-wide settings for dilog channels, accessed through the
+    // static dilog::options() method. These should be assigned before
+    // the first channel is opened, eg. dilog::options().save_index = true.
+ 
+      bool save_index;     // save the line index as <channel>.dilogx
+      int trace_level;     // one of DILOG_TRACE_NONE, _STACK, or _FILE
+      size_t write_buffer; // output buffer size in bytes, 0 to flush lines
+      bool binary_format;  // write new dilog files in the binary format
+      bool map_input;      // memory-map dilog files being checked
+      bool index_blocks;   // index block sets in the input before searching
+      unsigned int index_depth; // leading messages in block set index keys
+      bool prescan_blocks; // index all block sets on a helper thread at open
+      bool flush_at_exit;  // in buffered mode, flush all channels at exit
+      bool flush_on_signal; // in buffered mode, flush on fatal signals
+      size_t max_channels; // limit on the number of open channels, or 0
+      bool async_write;    // write record-mode output from a background thread
+      size_t async_buffer; // size in bytes of the async output ring per channel
+      std::string container; // if set, keep all channels in this container
+      size_t replay_window; // records kept for replay before trimming, or 0
+      bool collect_stats;  // time dilog calls and print stats() at exit
+      unsigned int sample_blocks;   // keep 1 in N top-level iterations
+      unsigned int sample_channels; // keep 1 in N channels, by name hash
+      bool compress_output; // write compressed files, needs DILOG_ZLIB
+      size_t compress_frame; // stream bytes per compressed frame
+      bool multi_process;  // tag file names with the MPI rank
+      std::string process_tag; // tag for file names, set from the rank
+      std::string output_dir; // directory for the files, if not the cwd
+      std::string gather_dir; // move closed files here from output_dir
+      std::string abort_file; // shared file announcing the first failure
+      unsigned int abort_poll; // milliseconds between abort_file checks
+      std::function<void(const std::string&)> on_divergence; // eg. MPI_Abort
+      std::string resume_at; // in check mode, start from this checkpoint
+      std::string stop_at; // in check mode, end at this checkpoint
+      bool report_divergence; // write <channel>.dilog.json on a fatal error
+      unsigned int report_context; // lines on either side in the report
+      bool save_actual;    // go on after a divergence, saving the runtime
+                           // stream in <channel>.dilog.actual
+
+      options_t()
+       : save_index(false), trace_level(DILOG_TRACE_FILE),
+         write_buffer(0), binary_format(false), map_input(true),
+         index_blocks(true), index_depth(2), prescan_blocks(false),
+         flush_at_exit(true), flush_on_signal(true), max_channels(0),
+         async_write(false), async_buffer(1 << 20), replay_window(4096),
+         collect_stats(false), sample_blocks(0), sample_channels(0),
+         compress_output(false), compress_frame(1 << 20),
+         multi_process(false), output_dir(env("DILOG_OUTPUT_DIR")),
+         abort_poll(200), resume_at(env("DILOG_RESUME_AT")),
+         stop_at(env("DILOG_STOP_AT")), report_divergence(false),
+         report_context(10), save_actual(false)
+      {}
+
+      static std::string env(const char *var)
+      {
+         // Default for a setting that a driver such as dilogbisect passes
+         // to the application through the environment.
+         const char *value = getenv(var);
+         return (value)? value : "";
+      }
+   };
+
+   static options_t &options() {
+      static options_t opts;
+      return opts;
+   }
+   struct stats_t {
+
+    // Counters of the work done by dilog on one channel, returned by
+    // stats(). The counters are always kept, while the time spent in the
+    // main dilog calls is only measured if options().collect_stats is
+    // set, which also prints a summary for every channel at exit. Times
+    // include those of the nested calls, eg. the next() calls made while
+    // checking a message are also counted in check_ns.
+ 
+      uint64_t messages;       // messages sent with printf
+      uint64_t enters;         // block iterations begun
+      uint64_t exits;          // block iterations ended
+      uint64_t lines_read;     // lines read from the input file
+      uint64_t lines_verified; // lines checked against the line index
+      uint64_t backtracks;     // searches for another iteration by next
+      uint64_t replay_steps;   // records replayed by block::replay
+      uint64_t bytes_written;  // bytes written to the output file
+      uint64_t bytes_read;     // bytes read from the input file
+      uint64_t printf_ns;      // nanoseconds spent in printf
+      uint64_t check_ns;       // nanoseconds spent in check_message
+      uint64_t enter_ns;       // nanoseconds spent in block::enter
+      uint64_t exit_ns;        // nanoseconds spent in block::exit
+      uint64_t next_ns;        // nanoseconds spent in block::next
+
+      stats_t()
+       : messages(0), enters(0), exits(0), lines_read(0), lines_verified(0),
+         backtracks(0), replay_steps(0), bytes_written(0), bytes_read(0),
+         printf_ns(0), check_ns(0), enter_ns(0), exit_ns(0), next_ns(0)
+      {}
+
+      void add(const stats_t &other)
+      {
+         messages += other.messages;
+         enters += other.enters;
+         exits += other.exits;
+         lines_read += other.lines_read;
+         lines_verified += other.lines_verified;
+         backtracks += other.backtracks;
+         replay_steps += other.replay_steps;
+         bytes_written += other.bytes_written;
+         bytes_read += other.bytes_read;
+         printf_ns += other.printf_ns;
+         check_ns += other.check_ns;
+         enter_ns += other.enter_ns;
+         exit_ns += other.exit_ns;
+         next_ns += other.next_ns;
+      }
+
+      static void print_header(std::ostream &out)
+      {
+         out << std::setw(24) << std::left << "channel" << std::right;
+         const char *cols[] = {"messages", "enters", "exits", "read",
+                               "verified", "backtracks", "replays",
+                               "bytes out", "bytes in", "printf ms",
+                               "check ms", "enter ms", "exit ms", "next ms"};
+         for (const char *col : cols)
+            out << std::setw(12) << col;
+         out << std::endl;
+      }
+
+      void print_json(std::ostream &out) const
+      {
+         const char *names[] = {"messages", "enters", "exits", "lines_read",
+                                "lines_verified", "backtracks",
+                                "replay_steps", "bytes_written",
+                                "bytes_read", "printf_ns", "check_ns",
+                                "enter_ns", "exit_ns", "next_ns"};
+         uint64_t values[] = {messages, enters, exits, lines_read,
+                              lines_verified, backtracks, replay_steps,
+                              bytes_written, bytes_read, printf_ns,
+                              check_ns, enter_ns, exit_ns, next_ns};
+         out << "{";
+         for (size_t i=0; i < sizeof(values) / sizeof(values[0]); ++i)
+            out << ((i > 0)? ", " : "") << "\"" << names[i] << "\": "
+                << values[i];
+         out << "}";
+      }
+
+      void print(std::ostream &out, const std::string &channel) const
+      {
+         out << std::setw(24) << std::left << channel << std::right;
+         uint64_t counts[] = {messages, enters, exits, lines_read,
+                              lines_verified, backtracks, replay_steps,
+                              bytes_written, bytes_read};
+         for (uint64_t count : counts)
+            out << std::setw(12) << count;
+         uint64_t times[] = {printf_ns, check_ns, enter_ns, exit_ns, next_ns};
+         for (uint64_t ns : times)
+            out << std::setw(12) << std::fixed << std::setprecision(3)
+                << ns * 1e-6;
+         out << std::endl;
+      }
+   };
+
+   const stats_t &stats() const {
+      return fStats;
+   }
+
+
+ protected:
+   dilog() = delete;
+
+   bool owned_here() const
+   {
+      // Check whether the calling thread owns this channel, see get.
+      task_context *task = fTask.load(std::memory_order_acquire);
+      if (task)
+         return task->attached();
+      return fThread_id == std::this_thread::get_id();
+   }
+
+   bool task_here() const
+   {
+      // Check that this channel does not belong to a task, or else that
+      // its task is attached to the calling thread.
+      task_context *task = fTask.load(std::memory_order_acquire);
+      return (task == 0 || task->attached());
+   }
+
+   void finish()
+   {
+    // Check that this channel is ready to be released, see release.
+ 
+      settle_actual();
+      stop_if_aborted("dilog::release");
+      if (fError.size() > 0)
+         clean_exit("dilog::release");
+      if (fBlock->parent != 0) {
+         fError = "dilog::release error: channel " + fChannel +
+                  " released inside open block " + fBlock->getPath();
+         clean_exit("dilog::release");
+      }
+      if (fResuming) {
+         fError = "dilog::release error: channel " + fChannel +
+                  " released before reaching checkpoint " +
+                  options().resume_at;
+         clean_exit("dilog::release");
+      }
+      if (fReading && !fStopped && fLineno == fLastLine) {
+         fError = "dilog::release error: channel " + fChannel +
+                  " released before reaching checkpoint " +
+                  options().stop_at;
+         clean_exit("dilog::release");
+      }
+      std::string nextmsg;
+      if (fReading && !fStopped && read_line(nextmsg) && !fReading->fail()) {
+         fError = "dilog::release error: expected end of input file " +
+                  fInput + ".dilog at line " + std::to_string(fLineno + 1) +
+                  " but found \"" + nextmsg + "\" instead.";
+         clean_exit("dilog::release");
+      }
+      flush();
+      if (fActual)
+         end_actual("dilog::release");
+   }
+
+   void invalidate_caches()
+   {
+    // Mark the pointers to this channel held in the thread caches of get
+    // as stale, so that the next lookup of the channel from any thread
+    // goes through the channel map. Called with get_lock() held.
+ 
+      fCached->store(false, std::memory_order_release);
+      fCached = std::make_shared<std::atomic<bool> >(true);
+   }
+
+   bool sampled(unsigned int parent, const std::string &name)
+   {
+    // Count an iteration of the top-level block with the given name in
+    // the block with path id parent, and return whether it is one of the
+    // 1 in options().sample_blocks that are recorded and checked,
+    // starting with the first one. The count is kept in the node of the
+    // block path, which is found among the few children of the root
+    // without hashing the name.
+ 
+      block_node &node = fNodes[child_path(parent, name)];
+      return (node.iterations++ % options().sample_blocks == 0);
+   }
+
+   void send_line(size_t head, size_t msglen)
+   {
+    // Send the message of msglen bytes that printf or log has laid down
+    // in fFormat behind its block path prefix of head bytes, cut short
+    // at the first newline, to the output stream or check it against
+    // the input, depending on the mode of the channel.
+ 
+      char *msg = &fFormat[head];
+      char *eos = (char*)memchr(msg, '\n', msglen);
       if (eos != NULL)
-         *eos = 0;
-      std::string message = "[" + fBlock->getPath() + "]" + msg;
+         msglen = eos - msg;
+      msg[msglen] = 0;
+      size_t linelen = head + msglen;
       if (fWriting) {
-         *fWriting << message << std::endl;
+         if (fBinary) {
+            write_record(DILOG_TAG_MESSAGE, path_id(fBlock->pathid),
+                         msg, msglen);
+         }
+         else {
+            endline(fWriting->write(&fFormat[0], linelen));
+            fStats.bytes_written += linelen + 1;
+         }
          ++fLineno;
+         if (fActual && !fWriting->good()) {
+            fError = "dilog::printf error - unable to write " + fFile +
+                     ".dilog.actual";
+            clean_exit("dilog::printf");
+         }
+      }
+      else if (fDigesting) {
+         fDigestRecord.push_back("[]", msg, msglen);
+         fDigest = key_hash(fDigest, &fFormat[0], linelen);
+      }
+      else {
+         check_line(&fFormat[0], linelen);
+      }
+   }
+
+   char *log_space(size_t &pos, size_t len)
+   {
+    // Return the place in fFormat for the next len bytes of a message
+    // being put together by log, growing fFormat if needed so that it
+    // still has room for the terminating null, and advance pos past it.
+ 
+      if (fFormat.size() < pos + len + 1)
+         fFormat.resize(std::max(2 * fFormat.size(), pos + len + 1));
+      char *dest = &fFormat[pos];
+      pos += len;
+      return dest;
+   }
+
+   void log_fields(size_t &) {}
+
+   template <typename T, typename... Args>
+   void log_fields(size_t &pos, const T &arg, const Args&... args)
+   {
+      log_field(pos, arg);
+      if (sizeof...(args) > 0)
+         *log_space(pos, 1) = ' ';
+      log_fields(pos, args...);
+   }
+
+   void log_field(size_t &pos, const char *str)
+   {
+      size_t len = strlen(str);
+      memcpy(log_space(pos, len), str, len);
+   }
+
+   void log_field(size_t &pos, const std::string &str)
+   {
+      memcpy(log_space(pos, str.size()), str.data(), str.size());
+   }
+
+   void log_field(size_t &pos, char c)
+   {
+      *log_space(pos, 1) = c;
+   }
+
+   void log_field(size_t &pos, bool b)
+   {
+      log_field(pos, (b)? "true" : "false");
+   }
+
+   // Pointers other than C strings would otherwise be taken as bools.
+   template <typename T>
+   void log_field(size_t &pos, const T *ptr) = delete;
+
+   template <typename T>
+   typename std::enable_if<std::is_integral<T>::value>::type
+   log_field(size_t &pos, T value)
+   {
+      // Write the digits from the right into a scratch buffer large
+      // enough for any 64-bit value.
+      char digits[24];
+      char *end = digits + sizeof(digits), *dig = end;
+      bool negative = (value < 0);
+      unsigned long long mag = (negative)? 0ULL - (unsigned long long)value
+                                         : (unsigned long long)value;
+      do {
+         *--dig = '0' + mag % 10;
+         mag /= 10;
+      } while (mag > 0);
+      if (negative)
+         *--dig = '-';
+      memcpy(log_space(pos, end - dig), dig, end - dig);
+   }
+
+   template <typename T>
+   typename std::enable_if<std::is_floating_point<T>::value>::type
+   log_field(size_t &pos, T value)
+   {
+      // Enough digits to round-trip the value, so that log never hides
+      // a difference between two runs.
+      char text[48];
+      int len;
+      if (std::is_same<T, float>::value)
+         len = snprintf(text, sizeof(text), "%.9g", (double)value);
+      else if (std::is_same<T, double>::value)
+         len = snprintf(text, sizeof(text), "%.17g", (double)value);
+      else
+         len = snprintf(text, sizeof(text), "%.21Lg", (long double)value);
+      memcpy(log_space(pos, len), text, len);
+   }
+
+   void check_line(const char *line, size_t linelen)
+   {
+    // Check printf message line, complete with its block path prefix,
+    // against the input file and record it in fRecord for future replay.
+ 
+      check_message(line, linelen);
+      if (fReplay) {
+         // std::cerr << "printf replays match step " 
+         //           << fReplay << "/" << fRecord.size()
+         //           << " at lineno " << fLineno 
+         //           << ": " << line << std::endl;
+         set_matched(fReplay, fLineno);
+      }
+      else {
+         // std::cerr << "printf records match step " 
+         //           << fRecord.size() << " at lineno "
+         //           << fLineno << ": " << line
+         //           << std::endl;
+         size_t head = fBlock->getPath().size() + 2;
+         set_matched(fRecord.size(), fLineno);
+         push_record("[]", line + head, linelen - head);
+         logger(line, linelen);
+      }
+   }
+
+   void check_message(const char *mexpected, size_t mlen)
+   {
+    // Validate printf message line mexpected, complete with its block
+    // path prefix, against the next content found in the input file,
+    // and report a fatal error if the match fails.
+ 
+      timer clock(fStats.check_ns);
+      // Fast path for the usual case of a match with the next line of
+      // a memory-mapped text input file, compared in place.
+      if (fMapped && !fBinary && !fReading->fail() && fLineno < fLastLine &&
+          (size_t)(fMapped->end() - fMapped->cur()) > mlen &&
+          fMapped->cur()[mlen] == '\n' &&
+          memcmp(fMapped->cur(), mexpected, mlen) == 0)
+      {
+         fLastlen = mlen + 1;
+         fMapped->skip(fLastlen);
+         ++fStats.lines_read;
+         fStats.bytes_read += fLastlen;
+         verify_line(mexpected, mlen, ++fLineno);
+         return;
+      }
+      std::string &nextmsg = fNextmsg;
+      size_t head = fBlock->getPath().size() + 2;
+      fPendingBlock = fBlock;
+      fPendingMsg.assign(mexpected + head, mlen - head);
+      fPendingLine = fLineno;
+      for (; read_next(nextmsg);) {
+         int nextline = fLineno;
+         if ((nextmsg.size() == mlen &&
+              memcmp(nextmsg.data(), mexpected, mlen) == 0) ||
+             (fTolerance.size() > 0 && tolerant_match(fBlock,
+                                        nextmsg.data(), nextmsg.size(),
+                                        mexpected, mlen)))
+         {
+            fPendingBlock = 0;
+            return;
+         }
+         else {
+            if (options().report_divergence)
+               note_attempt(*fBlock, fRecord.size() - fBlock->ireplay,
+                            nextmsg);
+            trace t(*fBlock, "check_message", "next");
+            if (fBlock->next(nextmsg)) {
+               continue;
+            }
+         }
+         if (fReading->fail())
+            break;
+         fError = "expected dilog message"
+                  " \"" + std::string(mexpected, mlen) + "\" at line " +
+                  std::to_string(nextline) + " in " + fInput + ".dilog"
+                  " but found \"" + nextmsg + "\" instead, search stopped"
+                  " at line " + std::to_string(fLineno);
+         clean_exit("dilog::check_message");
+      }
+      fError = "read error from input file " +
+               fInput + ".dilog after line " + std::to_string(fLineno) +
+               ": expected \"" + std::string(mexpected, mlen) +
+               "\" but found end-of-file.";
+      clean_exit("dilog::check_message");
+   }
+
+   struct tolerance_t {
+      unsigned int ulps;   // units in the last place
+      double rel;          // fraction of the magnitude
+      tolerance_t(unsigned int u=0, double r=0) : ulps(u), rel(r) {}
+   };
+
+   bool tolerant_match(const block *b, const char *found, size_t flen,
+                       const char *expected, size_t elen)
+   {
+    // Compare the line found in the input against the expected one,
+    // complete with their block path prefixes, allowing the floating
+    // point numbers in them to differ within the tolerance set for block
+    // b or the nearest block containing it, see set_tolerance. This is
+    // only called after an exact comparison has failed, so a channel
+    // without any tolerance set pays nothing for it.
+ 
+      const tolerance_t *tol = 0;
+      for (; b && tol == 0; b = b->parent) {
+         auto titer = fTolerance.find(b->getPath());
+         if (titer != fTolerance.end())
+            tol = &titer->second;
+      }
+      if (tol == 0 || (tol->ulps == 0 && tol->rel == 0))
+         return false;
+      // Both lines are walked in step, comparing their text exactly up
+      // to the start of a number, and then each number as a whole.
+      const char *fend = found + flen, *eend = expected + elen;
+      while (found < fend && expected < eend) {
+         size_t fnum = number_length(found, fend);
+         size_t enm = number_length(expected, eend);
+         if (fnum == 0 || enm == 0) {
+            if (*found++ != *expected++)
+               return false;
+            continue;
+         }
+         if (fnum != enm || memcmp(found, expected, fnum) != 0) {
+            if (!is_floating_text(found, fnum) &&
+                !is_floating_text(expected, enm))
+            {
+               return false;
+            }
+            std::string ftext(found, fnum), etext(expected, enm);
+            double fval = strtod(ftext.c_str(), 0);
+            double eval = strtod(etext.c_str(), 0);
+            if (!within_tolerance(fval, eval, *tol))
+               return false;
+         }
+         found += fnum;
+         expected += enm;
+      }
+      return (found == fend && expected == eend);
+   }
+
+   static size_t number_length(const char *str, const char *end)
+   {
+    // Return the length of the decimal number at the start of str, with
+    // an optional sign, fraction and exponent, or 0 if there is none.
+ 
+      const char *cur = str;
+      if (cur < end && (*cur == '+' || *cur == '-'))
+         ++cur;
+      const char *digits = cur;
+      while (cur < end && isdigit(*cur))
+         ++cur;
+      if (cur < end && *cur == '.') {
+         ++cur;
+         while (cur < end && isdigit(*cur))
+            ++cur;
+      }
+      if (cur - digits < 2 && (cur == digits || *digits == '.'))
+         return 0;
+      if (cur < end && (*cur == 'e' || *cur == 'E')) {
+         const char *exp = cur + 1;
+         if (exp < end && (*exp == '+' || *exp == '-'))
+            ++exp;
+         if (exp < end && isdigit(*exp)) {
+            cur = exp;
+            while (cur < end && isdigit(*cur))
+               ++cur;
+         }
+      }
+      return cur - str;
+   }
+
+   static bool is_floating_text(const char *str, size_t len)
+   {
+      return memchr(str, '.', len) || memchr(str, 'e', len) ||
+             memchr(str, 'E', len);
+   }
+
+   static bool within_tolerance(double a, double b, const tolerance_t &tol)
+   {
+    // Check whether a and b are within tol.ulps units in the last place
+    // of each other, counting across zero, or within tol.rel of the
+    // larger of their magnitudes.
+ 
+      if (a == b)
+         return true;
+      if (a != a || b != b)
+         return false;
+      if (tol.rel > 0 &&
+          fabs(a - b) <= tol.rel * std::max(fabs(a), fabs(b)))
+      {
+         return true;
+      }
+      int64_t ia, ib;
+      memcpy(&ia, &a, sizeof(a));
+      memcpy(&ib, &b, sizeof(b));
+      if (ia < 0)
+         ia = INT64_MIN - ia;
+      if (ib < 0)
+         ib = INT64_MIN - ib;
+      uint64_t diff = (ia > ib)? (uint64_t)ia - (uint64_t)ib
+                               : (uint64_t)ib - (uint64_t)ia;
+      return diff <= tol.ulps;
+   }
+
+   class timer {
+
+    // Adds the time from its construction to its destruction to a time
+    // counter in stats_t, if options().collect_stats is set.
+
+    public:
+      timer(uint64_t &ns)
+       : fNs((options().collect_stats)? &ns : 0)
+      {
+         if (fNs)
+            fStart = std::chrono::steady_clock::now();
+      }
+      ~timer() {
+         if (fNs)
+            *fNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - fStart).count();
+      }
+
+    private:
+      uint64_t *fNs;
+      std::chrono::steady_clock::time_point fStart;
+   };
+
+   class record_list {
+
+    // Sequence of the block entry, exit and message records kept in
+    // fRecord for replay, each one a two-character tag ("[[", "]]" or
+    // "[]") followed by a block path or message. The records are stored
+    // end to end in one character array, so that adding a record does no
+    // allocation once the list has grown to the size of a top-level block
+    // iteration, and clear keeps the storage for the next iteration.
+    // Records are numbered from the start of the list, and discard drops
+    // the oldest of them without renumbering the rest, so that positions
+    // such as block::ireplay stay valid. Only records from origin() up
+    // to size() are held in memory.
+
+    public:
+      struct record {
+         const char *data;
+         size_t size;
+         bool tagged(const char *tag) const {
+            return size >= 2 && data[0] == tag[0] && data[1] == tag[1];
+         }
+         std::string body() const {
+            return std::string(data + 2, data + size);
+         }
+         bool operator==(const std::string &str) const {
+            return str.size() == size - 2 &&
+                   str.compare(0, str.size(), data + 2, size - 2) == 0;
+         }
+      };
+
+      record_list() : fOrigin(0) {}
+
+      size_t size() const {
+         return fOrigin + fEnds.size();
+      }
+      size_t origin() const {
+         return fOrigin;
+      }
+      record operator[](size_t i) const {
+         i -= fOrigin;
+         size_t start = (i > 0)? fEnds[i - 1] : 0;
+         return record{&fData[start], fEnds[i] - start};
+      }
+      void push_back(const char *tag, const char *body, size_t len) {
+         fData.insert(fData.end(), tag, tag + 2);
+         fData.insert(fData.end(), body, body + len);
+         fEnds.push_back(fData.size());
+      }
+      void push_back(const char *tag, const std::string &body) {
+         push_back(tag, body.data(), body.size());
+      }
+      void push_back(const record &rec) {
+         fData.insert(fData.end(), rec.data, rec.data + rec.size);
+         fEnds.push_back(fData.size());
+      }
+      void clear() {
+         fData.clear();
+         fEnds.clear();
+         fOrigin = 0;
+      }
+      void discard(size_t i) {
+         // Drop all records before record i.
+         if (i <= fOrigin)
+            return;
+         size_t n = std::min(i, size()) - fOrigin;
+         size_t bytes = fEnds[n - 1];
+         fData.erase(fData.begin(), fData.begin() + bytes);
+         fEnds.erase(fEnds.begin(), fEnds.begin() + n);
+         for (auto &end : fEnds)
+            end -= bytes;
+         fOrigin += n;
+      }
+
+    private:
+      std::vector<char> fData;
+      std::vector<size_t> fEnds;
+      size_t fOrigin;
+   };
+
+   void set_matched(unsigned int step, unsigned int lineno)
+   {
+    // Record lineno as the input line that matched step of fRecord.
+ 
+      if (step < fRecord.origin())
+         return;
+      step -= fRecord.origin();
+      if (step >= fMatched.size())
+         fMatched.resize(step + 1, 0);
+      fMatched[step] = lineno;
+   }
+
+   void push_record(const char *tag, const char *body, size_t len)
+   {
+    // Append a new record to fRecord, outside of replay. Once more than
+    // options().replay_window records are held, first drop the ones that
+    // no backtrack can reach any more, see trim_record.
+ 
+      if (fRecordLimit > 0 && fRecord.size() - fRecord.origin() >=
+                              fRecordLimit)
+         trim_record();
+      fRecord.push_back(tag, body, len);
+   }
+
+   void push_record(const char *tag, const std::string &body)
+   {
+      push_record(tag, body.data(), body.size());
+   }
+
+   void trim_record()
+   {
+    // A backtrack starts with block::next on the innermost open block,
+    // which passes it on to the parent block whenever no unmatched
+    // iteration of the block remains after the current one, and
+    // whichever block takes it up replays fRecord from its ireplay. The
+    // oldest record that can still be replayed is therefore the entry
+    // record of the outermost open block that has iterations left, and
+    // there is none if all of them are on their last iteration. Records
+    // before that are dropped, and the limit for the next trim is set so
+    // that the cost of trimming is proportional to the records added.
+ 
+      size_t keep = fRecord.size();
+      for (block *b = fBlock; b->parent != 0; b = b->parent) {
+         block::block_links *bl = b->parent->find_links(b->pathid);
+         if (bl == 0 || bl->flink == 0 ||
+             std::upper_bound(bl->blinks.begin(), bl->blinks.end(),
+                              b->beginline) != bl->blinks.end())
+         {
+            keep = (b->ireplay > 0)? b->ireplay - 1 : 0;
+         }
+      }
+      size_t origin = fRecord.origin();
+      fRecord.discard(keep);
+      size_t n = fRecord.origin() - origin;
+      fMatched.erase(fMatched.begin(),
+                     fMatched.begin() + std::min(n, fMatched.size()));
+      size_t held = fRecord.size() - fRecord.origin();
+      fRecordLimit = std::max(options().replay_window, 2 * held);
+   }
+
+   void clear_record()
+   {
+    // Drop the whole replay record when a top-level block exits.
+ 
+      fRecord.clear();
+      fMatched.clear();
+      fRecordLimit = options().replay_window;
+      fAttempts.clear();
+   }
+
+   struct block_set {
+
+    // Index of the iterations of a block set in the input file, made by
+    // scan_set. lines holds the line number preceding the start of each
+    // iteration, ends the last line of each iteration, and endline the
+    // last line of the final iteration. Keys are hashes of the first
+    // n <= options().index_depth direct messages of an iteration (those
+    // not inside any inner block), each one mapping to the ordered list
+    // of iterations that begin that way. Digests are hashes of all of
+    // the lines inside an iteration, mapping to the iteration number.
+ 
+      std::string path;
+      std::vector<unsigned int> lines;
+      std::vector<unsigned int> ends;
+      unsigned int endline;
+      std::unordered_map<uint64_t, std::vector<unsigned int> > keys;
+      std::unordered_multimap<uint64_t, unsigned int> digests;
+   };
+
+   static uint64_t key_hash(uint64_t hash, const char *msg, size_t len)
+   {
+    // 64-bit FNV-1a hash of a sequence of messages, extended by msg
+ 
+      for (size_t i=0; i < len; ++i)
+         hash = (hash ^ (unsigned char)msg[i]) * 1099511628211ull;
+      return (hash ^ '\n') * 1099511628211ull;
+   }
+
+   static uint64_t key_of(uint64_t hash, unsigned int nmsg)
+   {
+      return (hash ^ nmsg) * 1099511628211ull;
+   }
+
+   const block_set *scan_set(const std::string &path, unsigned int lineno)
+   {
+    // Scan forward from line lineno through the set of iterations of
+    // block path that starts there, and return its index, or null if
+    // no iteration of the block begins at lineno. The index is kept in
+    // fSets for reuse, and the reader is left where it was found.
+ 
+      auto found = fSets.find(lineno);
+      if (found != fSets.end())
+         return &found->second;
+      if (fPrescan && fPrescan->done()) {
+         adopt_prescan();
+         auto pre = fPrescan->fSets.find(lineno);
+         if (pre != fPrescan->fSets.end())
+            return (pre->second.path == path)? &pre->second : 0;
+      }
+      unsigned int saveline = fLineno;
+      seek_line(lineno);
+      std::string enterline = "[" + path + "[";
+      std::string exitline = "]" + path + "]";
+      std::string direct = "[" + path + "]";
+      unsigned int depth = options().index_depth;
+      block_set bset;
+      bset.path = path;
+      std::string line;
+      while (read_line(line) && !fReading->fail()) {
+         verify_line(line, ++fLineno);
+         if (line != enterline)
+            break;
+         unsigned int iter = bset.lines.size();
+         bset.lines.push_back(fLineno - 1);
+         uint64_t hash = 14695981039346656037ull;
+         uint64_t digest = 14695981039346656037ull;
+         unsigned int nmsg = 0;
+         while (read_line(line) && !fReading->fail()) {
+            verify_line(line, ++fLineno);
+            if (line == exitline)
+               break;
+            digest = key_hash(digest, line.data(), line.size());
+            if (nmsg < depth && line.compare(0, direct.size(), direct) == 0)
+            {
+               hash = key_hash(hash, line.data() + direct.size(),
+                               line.size() - direct.size());
+               bset.keys[key_of(hash, ++nmsg)].push_back(iter);
+            }
+         }
+         if (line != exitline)
+            break;
+         bset.ends.push_back(fLineno);
+         bset.digests.insert(std::make_pair(digest, iter));
+         bset.endline = fLineno;
+      }
+      seek_line(saveline);
+      if (bset.lines.size() == 0)
+         return 0;
+      for (auto &kiter : bset.keys) {
+         for (auto &iter : kiter.second)
+            iter = bset.lines[iter];
+      }
+      block_set &saved = fSets[lineno];
+      std::swap(saved, bset);
+      return &saved;
+   }
+
+   class set_scanner {
+
+    // Background pass over an input dilog file, started when a channel
+    // opens in check mode with options().prescan_blocks set, that builds
+    // the block set index of scan_set for every run of iterations of a
+    // block in the file, keyed by the line preceding the first iteration
+    // of the run, together with the complete line index and, for binary
+    // input, the table of block paths. Once it is done, scan_set takes
+    // the index of a block set from here instead of scanning the input
+    // file for it, and the reader can seek to the end of the set even if
+    // it lies beyond the lines read so far.
+
+    public:
+      set_scanner(const std::string &fname, bool binary)
+       : fOk(false), fAdopted(false), fDone(false), fStop(false)
+      {
+         fThread = std::thread(&set_scanner::scan, this, fname, binary);
+      }
+
+      ~set_scanner()
+      {
+         fStop = true;
+         fThread.join();
+      }
+
+      bool done() const { return fDone.load(std::memory_order_acquire); }
+
+      std::map<unsigned int, block_set> fSets; // by line preceding a run
+      std::vector<std::streampos> fOffsets;    // complete line index
+      std::vector<std::string> fPaths;         // block paths by id
+      bool fOk;                                // file was scanned to the end
+      bool fAdopted;                           // see dilog::adopt_prescan
+
+    private:
+      struct open_iteration {
+         std::string exitline;   // line that ends this iteration
+         std::string direct;     // prefix of its direct messages
+         unsigned int run;       // key of its block set in fSets
+         unsigned int iter;      // iteration number within the set
+         uint64_t hash;          // key hash of its direct messages so far
+         uint64_t digest;        // digest of its lines so far
+         unsigned int nmsg;      // direct messages in hash
+      };
+
+      void scan(std::string fname, bool binary)
+      {
+         // Read the file once from the top, keeping a stack of the block
+         // iterations that are open at the current line. An iteration
+         // that is entered on the line right after the exit from one of
+         // the same block continues its set, as in scan_set.
+
+         std::unique_ptr<std::istream> in(open_file(fname));
+         if (in) {
+            fOffsets.assign(1, (binary)? DILOG_BINARY_HEADER : 0);
+            in->seekg(fOffsets[0]);
+         }
+         unsigned int depth = options().index_depth;
+         std::vector<open_iteration> open;
+         std::string lastpath;    // block exited on the previous line
+         unsigned int lastrun = 0;
+         std::string line;
+         size_t nbytes;
+         int stat = 0;
+         while (in && !fStop &&
+                (stat = read_record(*in, binary, fPaths, line, nbytes)) > 0)
+         {
+            fOffsets.push_back(fOffsets.back() + (std::streamoff)nbytes);
+            unsigned int lineno = fOffsets.size() - 1;
+            bool exited = (open.size() > 0 && line == open.back().exitline);
+            if (exited) {
+               open_iteration &it = open.back();
+               block_set &bset = fSets[it.run];
+               bset.ends.push_back(lineno);
+               bset.digests.insert(std::make_pair(it.digest, it.iter));
+               bset.endline = lineno;
+               lastpath = bset.path;
+               lastrun = it.run;
+               open.pop_back();
+            }
+            for (auto &it : open) {
+               it.digest = key_hash(it.digest, line.data(), line.size());
+            }
+            if (exited)
+               continue;
+            if (open.size() > 0) {
+               open_iteration &it = open.back();
+               if (it.nmsg < depth &&
+                   line.compare(0, it.direct.size(), it.direct) == 0)
+               {
+                  it.hash = key_hash(it.hash, line.data() + it.direct.size(),
+                                     line.size() - it.direct.size());
+                  fSets[it.run].keys[key_of(it.hash, ++it.nmsg)]
+                               .push_back(it.iter);
+               }
+            }
+            if (line.size() > 1 && line[0] == '[' && line.back() == '[' &&
+                line.find(']') == line.npos)
+            {
+               std::string path(line, 1, line.size() - 2);
+               unsigned int run = (lastpath.size() > 0 && path == lastpath)?
+                                  lastrun : lineno - 1;
+               block_set &bset = fSets[run];
+               if (bset.lines.size() == 0) {
+                  bset.path = path;
+                  bset.endline = 0;
+               }
+               open_iteration it = {"]" + path + "]", "[" + path + "]", run,
+                                    (unsigned int)bset.lines.size(),
+                                    14695981039346656037ull,
+                                    14695981039346656037ull, 0};
+               bset.lines.push_back(lineno - 1);
+               open.push_back(it);
+            }
+            lastpath.clear();
+         }
+         for (auto &siter : fSets) {
+            block_set &bset = siter.second;
+            for (auto &kiter : bset.keys) {
+               for (auto &iter : kiter.second)
+                  iter = bset.lines[iter];
+            }
+         }
+         fOk = (in && !fStop && stat == 0);
+         fDone.store(true, std::memory_order_release);
+      }
+
+      std::atomic<bool> fDone;
+      std::atomic<bool> fStop;
+      std::thread fThread;
+   };
+
+   void adopt_prescan()
+   {
+    // Take over the complete line index and path table from the finished
+    // prescan of the input file, the first time it is consulted.
+ 
+      if (fPrescan->fAdopted)
+         return;
+      fPrescan->fAdopted = true;
+      if (!fPrescan->fOk) {
+         fPrescan->fSets.clear();
+         return;
+      }
+      if (fPrescan->fOffsets.size() > fLineBase + fLineIndex.size()) {
+         fLineIndex.swap(fPrescan->fOffsets);
+         fLineBase = 0;
+      }
+      if (fPrescan->fPaths.size() > fPaths.size())
+         fPaths.swap(fPrescan->fPaths);
+   }
+
+   unsigned int runtime_key(const block &b, uint64_t &key)
+   {
+    // Compute the index key for the direct messages seen so far at
+    // runtime in the current iteration of block b, as recorded in
+    // fRecord from b.ireplay, followed by the message now being checked
+    // if it belongs to b. Returns the number of messages in the key.
+ 
+      unsigned int depth = options().index_depth;
+      uint64_t hash = 14695981039346656037ull;
+      unsigned int nmsg = 0;
+      int level = 0;
+      for (unsigned int i=b.ireplay; i < fRecord.size() && nmsg < depth; ++i)
+      {
+         record_list::record rec = fRecord[i];
+         if (rec.tagged("[["))
+            ++level;
+         else if (rec.tagged("]]") && --level < 0)
+            break;
+         else if (level == 0 && rec.tagged("[]")) {
+            hash = key_hash(hash, rec.data + 2, rec.size - 2);
+            ++nmsg;
+         }
+      }
+      if (level == 0 && nmsg < depth && fPendingBlock == &b) {
+         hash = key_hash(hash, fPendingMsg.data(), fPendingMsg.size());
+         ++nmsg;
+      }
+      key = key_of(hash, nmsg);
+      return nmsg;
+   }
+
+   void digest_record(const char *tag, const std::string &path)
+   {
+    // Append the block entry or exit record with tag and block path to
+    // the contents of the digest-mode block iteration being collected,
+    // see block::start_digest, and extend its digest by the corresponding
+    // line of the dilog file.
+ 
+      fDigestRecord.push_back(tag, path);
+      std::string line = tag[0] + path + tag[1];
+      fDigest = key_hash(fDigest, line.data(), line.size());
+   }
+
+   struct block_node {
+
+    // Node of the tree of block paths on a channel, one for each path
+    // that has been entered, indexed by its path id, with the root block
+    // of the channel at id 0. current is the block registered for the
+    // path, which is the user block of the open iteration if there is
+    // one, or else the saved copy of the last one, for use in replay.
+    // children holds the ids of the inner block paths, and index maps
+    // their names to ids once there are too many to be searched.
+    // iterations counts the iterations of a top-level block for sampling.
+
+      std::string name;
+      std::string path;
+      block *current;
+      std::vector<unsigned int> children;
+      std::unordered_map<std::string, unsigned int> index;
+      unsigned int iterations;
+   };
+
+   unsigned int root_path(const std::string &channel)
+   {
+    // Return the id of the root of the tree of block paths, which is
+    // the path of the channel itself.
+ 
+      if (fNodes.size() == 0) {
+         fNodes.push_back(block_node());
+         fNodes.back().path = channel;
+         fNodes.back().current = 0;
+         fNodes.back().iterations = 0;
+      }
+      return 0;
+   }
+
+   unsigned int find_path(unsigned int parent, const char *name,
+                          size_t len)
+   {
+    // Return the id of the path of inner block name within the block
+    // with path id parent, or -1 if it has not been entered before.
+ 
+      block_node &node = fNodes[parent];
+      if (node.index.size() > 0) {
+         auto iter = node.index.find(std::string(name, len));
+         return (iter == node.index.end())? -1 : iter->second;
+      }
+      for (auto id : node.children) {
+         const std::string &cname = fNodes[id].name;
+         if (cname.size() == len && memcmp(cname.data(), name, len) == 0)
+            return id;
+      }
+      return -1;
+   }
+
+   unsigned int child_path(unsigned int parent, const std::string &name)
+   {
+    // Return the id of the path of inner block name within the block
+    // with path id parent, adding a node to the tree for it the first
+    // time it is entered.
+ 
+      unsigned int id = find_path(parent, name.data(), name.size());
+      if (id != (unsigned int)-1)
+         return id;
+      id = fNodes.size();
+      fNodes.push_back(block_node());
+      block_node &node = fNodes.back();
+      node.name = name;
+      node.path = fNodes[parent].path + "/" + name;
+      node.current = 0;
+      node.iterations = 0;
+      block_node &pnode = fNodes[parent];
+      pnode.children.push_back(id);
+      if (pnode.index.size() > 0) {
+         pnode.index[name] = id;
+      }
+      else if (pnode.children.size() > 16) {
+         for (auto cid : pnode.children)
+            pnode.index[fNodes[cid].name] = cid;
+      }
+      return id;
+   }
+
+   block *find_child(unsigned int parent, const char *path, size_t len)
+   {
+    // Return the block registered for the inner block path of len bytes
+    // within the block with path id parent, or null if there is none.
+ 
+      const std::string &ppath = fNodes[parent].path;
+      size_t plen = ppath.size() + 1;
+      if (len <= plen || path[plen - 1] != '/' ||
+          memcmp(path, ppath.data(), ppath.size()) != 0)
+      {
+         return 0;
+      }
+      unsigned int id = find_path(parent, path + plen, len - plen);
+      return (id == (unsigned int)-1)? 0 : fNodes[id].current;
+   }
+
+   void trim_sets(const block &root)
+   {
+    // Discard the block set indices, apart from those still in use by
+    // the root block, once a top-level block iteration has finished.
+ 
+      auto siter = fSets.begin();
+      while (siter != fSets.end()) {
+         bool used = false;
+         for (auto &bl : root.links)
+            used |= (bl.bset == &siter->second);
+         if (used)
+            ++siter;
+         else
+            siter = fSets.erase(siter);
+      }
+   }
+
+   void verify_line(const std::string &msg, unsigned int lineno)
+   {
+      verify_line(msg.data(), msg.size(), lineno);
+   }
+
+   void verify_line(const char *msg, size_t msglen, unsigned int lineno)
+   {
+    // Check that the line msg just read from the input file is consistent
+    // with the current value of lineno. This is done against the line
+    // offset index fLineIndex, where fLineIndex[n] is the stream offset of
+    // the first byte past line n, so that the check is a single lookup
+    // instead of a rescan of the file from the top. Lines that have not
+    // been seen before are appended to the index as the reader advances.
+ 
+      ++fStats.lines_verified;
+      if (fReading->fail()) {
+         fError = "error on file " + fInput + ".dilog at line " +
+                  std::to_string(fLineBase + fLineIndex.size() - 1) +
+                  ": end of file " +
+                  fChannel + " found seeking line " + std::to_string(lineno);
+         clean_exit("dilog::verify_line");
+      }
+      std::streampos pos = read_offset();
+      lineno -= fLineBase;
+      if (lineno > fLineIndex.size() || lineno == 0 ||
+          pos - fLineIndex[lineno - 1] != (std::streamoff)fLastlen)
+      {
+         lineno += fLineBase;
+         fError = "error on line " + std::to_string(lineno) +
+                  ": found \"" + std::string(msg, msglen) + "\""
+                  " at an unexpected offset " +
+                  std::to_string(pos) + " in file " + fInput +
+                  ".dilog, line index is inconsistent";
+         clean_exit("dilog::verify_line");
+      }
+      else if (lineno == fLineIndex.size()) {
+         fLineIndex.push_back(pos);
+      }
+      else if (fLineIndex[lineno] != pos) {
+         fError = "error on line " + std::to_string(fLineBase + lineno) +
+                  ": found \"" + std::string(msg, msglen) + "\""
+                  " ending at offset " +
+                  std::to_string(pos) + " of file " + fChannel +
+                  ", expected offset " + std::to_string(fLineIndex[lineno]);
+         clean_exit("dilog::verify_line");
+      }
+   }
+
+   bool read_next(std::string &msg)
+   {
+    // Read the next line of the input file into msg for the search loops
+    // and check it against the line index. At end of file msg is left
+    // empty without a line being counted. No expected line is empty, so the
+    // end of the file ends the block set being scanned, as any other
+    // line that does not continue it. Returns false as read_line does.
+ 
+      if (!read_line(msg))
+         return false;
+      if (fReading->fail()) {
+         msg.clear();
+         return true;
+      }
+      ++fLineno;
+      verify_line(msg, fLineno);
+      return true;
+   }
+
+   std::streampos read_offset() const
+   {
+    // Return the current offset of the reader in the input file.
+ 
+      if (fMapped)
+         return fMapped->offset();
+      return fReading->tellg();
+   }
+
+   std::streampos line_offset(unsigned int lineno) const
+   {
+    // Return the stream offset of the start of line lineno+1 in the
+    // input file, ie. the position of the reader after line lineno
+    // has been consumed. Only lines already seen can be looked up.
+ 
+      assert(lineno >= fLineBase && lineno - fLineBase < fLineIndex.size());
+      return fLineIndex[lineno - fLineBase];
+   }
+
+   void seek_line(unsigned int lineno)
+   {
+    // Reposition the input stream immediately following line lineno
+    // and reset the line counter to match, using the line index.
+ 
+      fReading->clear();
+      fReading->seekg(line_offset(lineno));
+      fLineno = lineno;
+   }
+
+   bool load_index()
+   {
+    // Read the saved line index for this channel from <channel>.dilogx
+    // if one exists and was built from an input file of the same size,
+    // otherwise leave the index as is and return false.
+ 
+      std::ifstream xfile((fInput + ".dilogx").c_str(), std::ios::binary);
+      char magic[sizeof(DILOG_INDEX_MAGIC)];
+      uint64_t fsize, nlines;
+      if (!xfile.read(magic, sizeof(magic)) ||
+          memcmp(magic, DILOG_INDEX_MAGIC, sizeof(magic)) != 0 ||
+          !xfile.read((char*)&fsize, sizeof(fsize)) ||
+          !xfile.read((char*)&nlines, sizeof(nlines)))
+      {
+         return false;
+      }
+      fReading->seekg(0, std::ios::end);
+      uint64_t dsize = fReading->tellg();
+      fReading->seekg(0);
+      if (fsize != dsize || nlines == 0)
+         return false;
+      std::vector<uint64_t> offsets(nlines);
+      if (!xfile.read((char*)offsets.data(), nlines * sizeof(uint64_t)))
+         return false;
+      fLineIndex.assign(offsets.begin(), offsets.end());
+      return true;
+   }
+
+   void save_index()
+   {
+    // Write the complete line index for file <channel>.dilog into a
+    // sidecar file <channel>.dilogx, so that later runs can start with
+    // the full index in hand. This takes a single pass over the file.
+ 
+      std::string fname(fInput + ".dilog");
+      std::istream *dfile = open_file(fname);
+      if (dfile == 0)
+         return;
+      std::vector<uint64_t> offsets(1, (fBinary)? DILOG_BINARY_HEADER : 0);
+      std::vector<std::string> paths;
+      std::string line;
+      size_t nbytes;
+      dfile->seekg(offsets[0]);
+      while (read_record(*dfile, fBinary, paths, line, nbytes) > 0)
+         offsets.push_back(offsets.back() + nbytes);
+      delete dfile;
+      uint64_t fsize = offsets.back();
+      uint64_t nlines = offsets.size();
+      std::ofstream xfile((fname + "x").c_str(), std::ios::binary);
+      xfile.write(DILOG_INDEX_MAGIC, sizeof(DILOG_INDEX_MAGIC));
+      xfile.write((char*)&fsize, sizeof(fsize));
+      xfile.write((char*)&nlines, sizeof(nlines));
+      xfile.write((char*)offsets.data(), nlines * sizeof(uint64_t));
+   }
+
+   struct checkpoint_t {
+      unsigned int lineno;     // last line before the checkpoint
+      uint64_t offset;         // stream offset following that line
+      size_t npaths;           // binary block paths defined by then
+   };
+
+   void save_checkpoint(const std::string &marker)
+   {
+    // Append a checkpoint with the current output position to the
+    // sidecar file <channel>.dilogk, a text file with one line
+    // "K <lineno> <offset> <npaths> <marker>" for each checkpoint,
+    // preceded in binary mode by lines "P <path>" for the block paths
+    // defined since the one before, which a resumed check needs to
+    // decode the records that follow.
+ 
+      if (fCheckpoints == 0)
+         fCheckpoints = new std::ofstream((fFile + ".dilogk").c_str());
+      if (fBinary) {
+         for (; fCheckpointPaths < fPathNodes.size(); ++fCheckpointPaths) {
+            *fCheckpoints << "P " << fNodes[fPathNodes[fCheckpointPaths]].path
+                          << "\n";
+         }
+      }
+      *fCheckpoints << "K " << fLineno << " " << fStats.bytes_written
+                    << " " << fCheckpointPaths << " " << marker << std::endl;
+      if (!fCheckpoints->good()) {
+         fError = "dilog::checkpoint error - unable to write " + fFile +
+                  ".dilogk";
+         clean_exit("dilog::checkpoint");
+      }
+   }
+
+   void load_checkpoints()
+   {
+    // Read the checkpoints saved for this channel in <channel>.dilogk,
+    // if there is one, see save_checkpoint.
+ 
+      std::ifstream kfile((fInput + ".dilogk").c_str());
+      std::string line;
+      while (std::getline(kfile, line)) {
+         if (line.compare(0, 2, "P ") == 0) {
+            fMarkPaths.push_back(line.substr(2));
+            continue;
+         }
+         std::istringstream fields(line);
+         std::string tag, marker;
+         checkpoint_t cp;
+         if (fields >> tag >> cp.lineno >> cp.offset >> cp.npaths &&
+             tag == "K" && fields.get() == ' ' && std::getline(fields, marker)
+             && cp.npaths <= fMarkPaths.size())
+         {
+            fMarks.insert(std::make_pair(marker, cp));
+         }
+      }
+   }
+
+   void resume(const checkpoint_t &cp)
+   {
+    // Start checking from the checkpoint cp, as if the input file began
+    // there, with no memory of the iterations of any block before it.
+ 
+      fResuming = false;
+      fSkipping = 0;
+      if (fBinary && cp.npaths > fPaths.size())
+         fPaths.assign(fMarkPaths.begin(), fMarkPaths.begin() + cp.npaths);
+      if (cp.lineno >= fLineBase + fLineIndex.size()) {
+         fLineBase = cp.lineno;
+         fLineIndex.assign(1, cp.offset);
+      }
+      else if (line_offset(cp.lineno) != (std::streampos)cp.offset) {
+         fError = "dilog::checkpoint error - checkpoint " +
+                  options().resume_at + " does not agree with the line"
+                  " index of " + fInput + ".dilog";
+         clean_exit("dilog::checkpoint");
+      }
+      seek_line(cp.lineno);
+      fBlock->links.clear();
+      fBlock->beginline = cp.lineno;
+      fSets.clear();
+      clear_record();
+   }
+
+   void clean_exit(std::string src="")
+   {
+      if (fUnsettled)
+         return;
+      if (src.size() > 0)
+         std::cerr << "Fatal error from " << src << ": ";
+      std::cerr << fError << std::endl;
+      flush();
+      if (fActual || watcher().fAborted.load(std::memory_order_acquire))
+         exit(9);
+      if (options().abort_file.size() > 0 || options().on_divergence) {
+         std::string report = "channel " + fChannel;
+         if (process_tag().size() > 0)
+            report += " of process " + process_tag();
+         report += " stopped on line " + std::to_string(fLineno) + ": " +
+                   fError;
+         broadcast(report);
+      }
+      if (options().report_divergence)
+         write_report(src);
+      if (options().save_actual && fReading && save_actual())
+         return;
+      exit(9);
+   }
+
+   struct attempt_t {
+      unsigned int pathid;     // block of the iteration tried
+      unsigned int beginline;  // line preceding the iteration
+      size_t matched;          // runtime records it matched
+      unsigned int stopline;   // line where it failed, or 0
+      std::string found;       // text of that line
+   };
+
+   void note_attempt(const block &b, size_t matched, const std::string &found)
+   {
+    // Keep track of the iterations tried by the search in the current
+    // top-level block iteration for the divergence report, when the
+    // search enters one, with found empty, or when the runtime stream
+    // fails to match it after matched records, at a line containing
+    // found. Only the last DILOG_REPORT_ATTEMPTS are kept.
+ 
+      if (found.size() == 0 || fAttempts.size() == 0 ||
+          fAttempts.back().pathid != b.pathid ||
+          fAttempts.back().beginline != b.beginline)
+      {
+         if (fAttempts.size() == DILOG_REPORT_ATTEMPTS)
+            fAttempts.pop_front();
+         fAttempts.push_back(attempt_t{b.pathid, b.beginline, 0, 0, ""});
+      }
+      attempt_t &at = fAttempts.back();
+      if (found.size() > 0) {
+         at.matched = matched;
+         at.stopline = fLineno;
+         at.found = found;
+      }
+   }
+
+   static std::string json_string(const std::string &str)
+   {
+    // Return str as a quoted JSON string.
+ 
+      std::string quoted("\"");
+      for (unsigned char c : str) {
+         if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+         }
+         else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            quoted += esc;
+         }
+         else {
+            quoted += c;
+         }
+      }
+      return quoted + "\"";
+   }
+
+   std::vector<std::pair<unsigned int, std::string> > expected_lines()
+   {
+    // Return the lines of the input file within options().report_context
+    // lines of the line where the check stopped, read with a reader of
+    // their own, by line number.
+ 
+      std::vector<std::pair<unsigned int, std::string> > lines;
+      unsigned int context = options().report_context;
+      unsigned int first = (fLineno > context)? fLineno - context - 1 : 0;
+      first = std::max(first, fLineBase);
+      if (fContained || first >= fLineBase + fLineIndex.size())
+         return lines;
+      std::unique_ptr<std::istream> in(open_file(fInput + ".dilog"));
+      if (!in)
+         return lines;
+      in->seekg(line_offset(first));
+      std::vector<std::string> paths(fPaths);
+      std::string line;
+      size_t nbytes;
+      for (unsigned int n = first + 1; n <= fLineno + context &&
+           read_record(*in, fBinary, paths, line, nbytes) > 0; ++n)
+      {
+         lines.push_back(std::make_pair(n, line));
+      }
+      return lines;
+   }
+
+   std::vector<std::string> actual_lines()
+   {
+    // Return the last options().report_context records of the runtime
+    // stream in the current top-level block iteration as dilog lines,
+    // ending with the message that failed to match, if there is one.
+ 
+      std::string path;
+      std::vector<std::string> lines(record_lines(options().report_context,
+                                                  path));
+      if (fPendingBlock)
+         lines.push_back("[" + fPendingBlock->getPath() + "]" + fPendingMsg);
+      return lines;
+   }
+
+   std::vector<std::string> record_lines(size_t count, std::string &path)
+   {
+    // Return the last count records held in fRecord as dilog lines, in
+    // order. The block path of each message is found by walking back
+    // from the current block, and path is left holding the block path
+    // in effect before the first of them.
+ 
+      std::vector<std::string> lines;
+      block *b = (fPendingBlock)? fPendingBlock : fBlock;
+      path = b->getPath();
+      for (size_t i = fRecord.size(); i > fRecord.origin() &&
+           lines.size() < count;)
+      {
+         record_list::record rec = fRecord[--i];
+         if (rec.tagged("[]")) {
+            lines.push_back("[" + path + "]" + rec.body());
+         }
+         else if (rec.tagged("]]")) {
+            path = rec.body();
+            lines.push_back("]" + path + "]");
+         }
+         else {
+            lines.push_back("[" + rec.body() + "[");
+            path = rec.body();
+            path.erase(std::min(path.rfind('/'), path.size()));
+         }
+      }
+      std::reverse(lines.begin(), lines.end());
+      return lines;
+   }
+
+   void write_report(const std::string &src)
+   {
+    // Write a report of the fatal error on this channel in JSON to
+    // <channel>.dilog.json, with the stack of open blocks, the lines of
+    // the input file around the line where the check stopped, the last
+    // records of the runtime stream, the iterations that the search for
+    // a match tried in the current top-level iteration and how far each
+    // one of them matched, and the counters of stats().
+ 
+      std::ofstream out((fFile + ".dilog.json").c_str());
+      out << "{" << std::endl
+          << "  \"channel\": " << json_string(fChannel) << "," << std::endl
+          << "  \"process\": " << json_string(process_tag()) << ","
+          << std::endl
+          << "  \"source\": " << json_string(src) << "," << std::endl
+          << "  \"error\": " << json_string(fError) << "," << std::endl
+          << "  \"file\": " << json_string(fInput + ".dilog") << ","
+          << std::endl
+          << "  \"line\": " << fLineno << "," << std::endl
+          << "  \"blocks\": [";
+      const char *sep = "";
+      for (block *b = (fPendingBlock)? fPendingBlock : fBlock; b != 0;
+           b = b->parent, sep = ",")
+      {
+         out << sep << std::endl
+             << "    {\"path\": " << json_string(b->getPath())
+             << ", \"beginline\": " << b->beginline << "}";
+      }
+      out << std::endl << "  ]," << std::endl << "  \"expected\": [";
+      sep = "";
+      for (auto &line : expected_lines()) {
+         out << sep << std::endl
+             << "    {\"line\": " << line.first
+             << ", \"text\": " << json_string(line.second) << "}";
+         sep = ",";
+      }
+      out << std::endl << "  ]," << std::endl << "  \"actual\": [";
+      sep = "";
+      for (auto &line : actual_lines()) {
+         out << sep << std::endl << "    " << json_string(line);
+         sep = ",";
+      }
+      out << std::endl << "  ]," << std::endl << "  \"attempts\": [";
+      sep = "";
+      for (auto &at : fAttempts) {
+         out << sep << std::endl
+             << "    {\"block\": " << json_string(fNodes[at.pathid].path)
+             << ", \"beginline\": " << at.beginline
+             << ", \"matched\": " << at.matched
+             << ", \"stopline\": " << at.stopline
+             << ", \"found\": " << json_string(at.found) << "}";
+         sep = ",";
+      }
+      out << std::endl << "  ]," << std::endl << "  \"stats\": ";
+      fStats.print_json(out);
+      out << std::endl << "}" << std::endl;
+      if (!out.good())
+         std::cerr << "dilog::write_report error - unable to write "
+                   << fFile << ".dilog.json" << std::endl;
+   }
+
+   bool save_actual()
+   {
+    // Carry on after a fatal error in check mode, writing the runtime
+    // stream in text form to <channel>.dilog.actual instead of checking
+    // it, for comparison with the recorded file offline. The file starts
+    // with the records held for replay in the current top-level block
+    // iteration, led by the entries of any blocks whose own records were
+    // dropped, and then the message that failed, so that it is a stream
+    // of whole block iterations that follows the line of the recorded
+    // file given by dilogdiff -s. The stream ends with the top-level
+    // block iteration in which the check failed, or at once if it failed
+    // outside any block, see end_actual.
+ 
+      std::ofstream *actual = new std::ofstream((fFile +
+                                                 ".dilog.actual").c_str());
+      if (!actual->good()) {
+         delete actual;
+         return false;
+      }
+      std::string path;
+      std::vector<std::string> lines(record_lines(fRecord.size(), path));
+      std::vector<std::string> heads;
+      for (size_t n = path.find('/', fChannel.size());
+           n != std::string::npos;)
+      {
+         n = path.find('/', n + 1);
+         heads.push_back("[" + path.substr(0, n) + "[");
+      }
+      lines.insert(lines.begin(), heads.begin(), heads.end());
+      if (fPendingBlock)
+         lines.push_back("[" + fPendingBlock->getPath() + "]" + fPendingMsg);
+      unsigned int skip = fPendingLine;
+      block *top = (fPendingBlock)? fPendingBlock : fBlock;
+      while (top->parent != 0 && top->parent->parent != 0)
+         top = top->parent;
+      if (heads.size() > 0 && top->parent != 0) {
+         skip = top->beginline;
+      }
+      else if (fRecord.size() > 0 && fMatched.size() > 0 && fMatched[0] > 0) {
+         skip = fMatched[0] - 1;
+      }
+      std::cerr << "dilog: saving the failing iteration of channel "
+                << fChannel << " in " << fFile << ".dilog.actual, compare with"
+                << " dilogdiff -s " << skip << " " << fInput << ".dilog "
+                << fFile << ".dilog.actual" << std::endl;
+      fActual = true;
+      fWriting = actual;
+      fBinary = false;
+      fLineno = 0;
+      for (auto &line : lines)
+         write_text(line);
+      fDigesting = 0;
+      fReplay = 0;
+      bool outside = (fPendingBlock && fPendingBlock->parent == 0);
+      fPendingBlock = 0;
+      fError.clear();
+      fUnsettled = true;
+      if (outside)
+         end_actual("dilog::check_message");
+      return true;
+   }
+
+   void end_actual(const char *src)
+   {
+    // Close the actual stream written by save_actual, once the top-level
+    // block iteration in which the check failed has exited, or when the
+    // channel is released, and stop with status 9 from this call, as on
+    // any other fatal error, so that the process exits normally.
+ 
+      flush();
+      if (!fWriting->good()) {
+         fError = std::string(src) + " error - unable to write " + fFile +
+                  ".dilog.actual";
+         std::cerr << "Fatal error from " << src << ": " << fError
+                   << std::endl;
+      }
+      std::cerr << "dilog: saved channel " << fChannel << " in " << fFile
+                << ".dilog.actual up to line " << fLineno << ", stopping"
+                << std::endl;
+      exit(9);
+   }
+
+   bool save_digest(block &b, const record_list &contents, size_t i,
+                    bool entered)
+   {
+    // Called from block::match_digest when the check of digest-mode
+    // block iteration b fails at record i of its contents, or at its
+    // entry if it was not entered, or at its exit if i is the end of the
+    // contents. If save_actual lets the channel go on, the rest of the
+    // iteration is written to the actual stream from the item that
+    // failed, or from the next one if that was a message, which
+    // save_actual writes itself. Return false if the check stops here.
+ 
+      if (!fActual) {
+         if (!options().save_actual)
+            return false;
+         clean_exit("dilog::block::match_digest");
+      }
+      std::string path(b.getPath());
+      if (entered)
+         path = fBlock->getPath();
+      else
+         write_text("[" + path + "[");
+      for (; i < contents.size(); ++i) {
+         record_list::record rec = contents[i];
+         if (rec.tagged("[[")) {
+            path = rec.body();
+            write_text("[" + path + "[");
+         }
+         else if (rec.tagged("]]")) {
+            path = rec.body();
+            write_text("]" + path + "]");
+            path.erase(std::min(path.rfind('/'), path.size()));
+         }
+         else {
+            write_text("[" + path + "]" + rec.body());
+         }
+      }
+      write_text("]" + b.getPath() + "]");
+      return true;
+   }
+
+   void write_text(const std::string &line)
+   {
+    // Write line to the end of the actual stream, see save_actual.
+ 
+      endline(*fWriting << line);
+      fStats.bytes_written += line.size() + 1;
+      ++fLineno;
+   }
+
+   void stop_if_aborted(const char *src)
+   {
+    // Stop this channel, from the thread that is using it, once the
+    // abort watcher has seen the report of a failure in another process
+    // of the job, see abort_watcher.
+ 
+      abort_watcher &w = watcher();
+      if (w.fAborted.load(std::memory_order_acquire)) {
+         fError = "stopping on the failure reported in " +
+                  options().abort_file + ": " + w.fReport;
+         clean_exit(src);
+      }
+   }
+
+   void settle_actual()
+   {
+    // Drop the errors left behind by the check that stopped when this
+    // channel went on to save the actual stream, once the call that
+    // stopped it is over. Errors from then on are fatal again.
+ 
+      if (fUnsettled) {
+         fError.clear();
+         fUnsettled = false;
+      }
+   }
+
+   static const std::string &process_tag()
+   {
+    // Return the tag added to the names of all dilog files written by
+    // this process, which is options().process_tag if it is set, or in
+    // multi_process mode the rank of the process in its MPI job as found
+    // in the environment set up by the launcher, otherwise empty. The
+    // process id is no substitute, as it changes from one run to the
+    // next, so that a check would silently record new files instead.
+ 
+      static std::string tag;
+      static bool done(false);
+      if (done)
+         return tag;
+      done = true;
+      tag = options().process_tag;
+      if (tag.size() > 0 || !options().multi_process)
+         return tag;
+      const char *vars[] = {"OMPI_COMM_WORLD_RANK", "PMIX_RANK", "PMI_RANK",
+                            "MV2_COMM_WORLD_RANK", "SLURM_PROCID"};
+      for (const char *var : vars) {
+         const char *rank = getenv(var);
+         if (rank && *rank) {
+            tag = "rank" + std::string(rank);
+            return tag;
+         }
+      }
+      return tag;
+   }
+
+   static std::string file_stem(const std::string &name)
+   {
+    // Return the path of the dilog files for channel or container name,
+    // without the suffix, for example <output_dir>/<name>.<tag>.
+ 
+      std::string stem(name);
+      if (process_tag().size() > 0)
+         stem += "." + process_tag();
+      if (options().output_dir.size() > 0)
+         stem = options().output_dir + "/" + stem;
+      return stem;
+   }
+
+   void gather(bool checking)
+   {
+    // Move the closed files of this channel from options().output_dir
+    // to options().gather_dir, copying them if they cannot be renamed,
+    // eg. from node-local scratch to a shared filesystem. The input
+    // files of a channel that was checking are left where they are. A
+    // file that is already in gather_dir is never replaced, so that the
+    // recorded files of an earlier run are not lost, and the new one is
+    // left in place with an error.
+ 
+      const char *suffixes[] = {".dilog", ".dilog2", ".dilogx", ".dilogk",
+                                ".dilog.json", ".dilog.actual"};
+      for (const char *suffix : suffixes) {
+         std::string src(fFile + suffix);
+         std::string dst(gather_stem() + suffix);
+         if ((checking && (strcmp(suffix, ".dilog") == 0 ||
+                           strcmp(suffix, ".dilogk") == 0)) ||
+             !file_exists(src))
+         {
+            continue;
+         }
+         else if (file_exists(dst)) {
+            std::cerr << "dilog::gather error - " << dst << " already"
+                      << " exists, leaving " << src << " in place"
+                      << std::endl;
+            continue;
+         }
+         else if (rename(src.c_str(), dst.c_str()) == 0) {
+            continue;
+         }
+         std::ifstream in(src.c_str(), std::ios::binary);
+         std::ofstream out(dst.c_str(), std::ios::binary);
+         out << in.rdbuf();
+         if (out.good()) {
+            remove(src.c_str());
+         }
+         else {
+            std::cerr << "dilog::gather error - unable to copy " << src
+                      << " to " << dst << std::endl;
+         }
+      }
+   }
+
+   std::string gather_stem() const
+   {
+    // Return the path of the files of this channel in
+    // options().gather_dir, without the suffix.
+ 
+      size_t base = fFile.rfind('/');
+      base = (base == fFile.npos)? 0 : base + 1;
+      return options().gather_dir + "/" + fFile.substr(base);
+   }
+
+   static bool file_exists(const std::string &fname)
+   {
+      return access(fname.c_str(), F_OK) == 0;
+   }
+
+   static void broadcast(const std::string &report)
+   {
+    // Announce a fatal error in this process to the other processes of
+    // the job, by publishing the report in options().abort_file unless
+    // another process got there first, and by calling the
+    // options().on_divergence hook, eg. one that calls MPI_Abort. The
+    // report is written to a file of its own and renamed into place, so
+    // that a file left over from an earlier run is replaced in one step
+    // and the watchers never read a partial report.
+ 
+      const std::string &fname = options().abort_file;
+      if (fname.size() > 0) {
+         abort_watcher &w = watcher();
+         w.fOwn = true;
+         if (!w.reported()) {
+            char host[256] = "";
+            gethostname(host, sizeof(host) - 1);
+            std::string tmpname(fname + "." + host + "." +
+                                std::to_string(getpid()) + ".tmp");
+            std::string line(report + "\n");
+            int fd = ::open(tmpname.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool done = (fd >= 0 &&
+                         ::write(fd, line.data(), line.size()) ==
+                         (ssize_t)line.size());
+            if (fd >= 0 && ::close(fd) != 0)
+               done = false;
+            if (done && ::rename(tmpname.c_str(), fname.c_str()) != 0)
+               done = false;
+            if (!done) {
+               std::string why(strerror(errno));
+               ::unlink(tmpname.c_str());
+               std::cerr << "dilog::broadcast error - unable to publish the"
+                         << " report in " << fname << ": " << why
+                         << ", the other processes will not be stopped"
+                         << std::endl;
+            }
+         }
+      }
+      if (options().on_divergence)
+         options().on_divergence(report);
+   }
+
+   struct abort_watcher {
+
+    // Background thread that watches for options().abort_file to appear,
+    // or to be replaced if it was already there when the watch began,
+    // and then raises fAborted with the report found in it, so that the
+    // first failure in any process of a job stops the whole job. The
+    // watcher does not stop the process itself. Each channel stops on
+    // its own thread at its next call, see stop_if_aborted, so a thread
+    // that makes no more dilog calls is not stopped by it.
+
+      std::atomic<bool> fOwn;      // this process wrote the abort file
+      std::atomic<bool> fAborted;  // another process reported a failure
+      std::string fReport;         // its report, set before fAborted
+      bool fStarted;
+      bool fExisted;               // a file was there when the watch began
+      struct stat fStat0;          // and this was it
+      std::thread fThread;
+      std::mutex fMutex;
+      std::condition_variable fWake;
+      bool fStop;                  // guarded by fMutex
+
+      abort_watcher()
+       : fOwn(false), fAborted(false), fStarted(false), fExisted(false),
+         fStop(false)
+      {}
+
+      ~abort_watcher() {
+         stop();
+      }
+
+      bool reported() const
+      {
+         // Return true if the abort file holds the report of a failure in
+         // this run, ie. it is not the one seen when the watch began.
+
+         struct stat st;
+         if (!fStarted || stat(options().abort_file.c_str(), &st) != 0)
+            return false;
+         return !fExisted || st.st_ino != fStat0.st_ino ||
+                st.st_mtime != fStat0.st_mtime;
+      }
+
+      void start()
+      {
+         if (fStarted || options().abort_file.size() == 0)
+            return;
+         fExisted = (stat(options().abort_file.c_str(), &fStat0) == 0);
+         fStarted = true;
+         std::chrono::milliseconds poll(options().abort_poll);
+         fThread = std::thread([this, poll]{
+            std::unique_lock<std::mutex> lock(fMutex);
+            while (!fWake.wait_for(lock, poll, [this]{ return fStop; })) {
+               if (fOwn || !reported())
+                  continue;
+               std::ifstream in(options().abort_file.c_str());
+               std::getline(in, fReport);
+               fAborted.store(true, std::memory_order_release);
+               break;
+            }
+         });
+      }
+
+      void stop()
+      {
+         // Stop the watch and wait for the thread to finish, which is
+         // done at exit by dilogs_holder before the statics it reads
+         // are destroyed.
+
+         if (!fThread.joinable())
+            return;
+         {
+            std::lock_guard<std::mutex> guard(fMutex);
+            fStop = true;
+         }
+         fWake.notify_all();
+         fThread.join();
+      }
+   };
+
+   static abort_watcher &watcher() {
+      static abort_watcher w;
+      return w;
+   }
+
+   std::istream *open_input(const std::string &fname)
+   {
+    // Open the recorded input stream fname for this channel, from a
+    // container in container mode, or else from the file fname, and
+    // return it, or null if it does not exist.
+ 
+      if (fContained) {
+         fMapped = get_container(file_stem(options().container) +
+                                 ".dilog").open(fChannel);
+         return (fMapped)? new std::istream(fMapped) : 0;
       }
-      else {
-         check_message(msg);
-         if (fReplay) {
-            // std::cerr << "printf replays match step " 
-            //           << fReplay << "/" << fRecord.size()
-            //           << " at lineno " << fLineno 
-            //           << ": []" << msg << std::endl;
-            fMatched[fReplay] = fLineno;
+      std::ifstream *in = new std::ifstream(fname.c_str(), std::ios::binary);
+      if (!in->good()) {
+         delete in;
+         return 0;
+      }
+      if (is_compressed(fname)) {
+         delete in;
+#if DILOG_ZLIB
+         return new frame_istream(fname);
+#else
+         fError = "dilog constructor error - input file " + fname +
+                  " is compressed, but dilog was built without DILOG_ZLIB";
+         return new std::istringstream;
+#endif
+      }
+#if DILOG_MMAP
+      if (options().map_input) {
+         fMapped = new mapped_buffer(fname);
+         if (fMapped->good()) {
+            delete in;
+            return new std::istream(fMapped);
          }
-         else {
-            // std::cerr << "printf records match step " 
-            //           << fRecord.size() << " at lineno "
-            //           << fLineno << ": []" << msg
-            //           << std::endl;
-            fMatched[fRecord.size()] = fLineno;
-            fRecord.push_back("[]" + std::string(msg));
-            logger("[" + fBlock->getPath() + "]" + msg);
+         delete fMapped;
+         fMapped = 0;
+      }
+#endif
+      return in;
+   }
+
+   std::ostream *open_output(const std::string &fname)
+   {
+    // Open a new output file for this channel, or a new stream in the
+    // container for files of this kind in container mode. In buffered
+    // mode the stream is given a private buffer of options().write_buffer
+    // bytes, and lines are terminated without flushing, see endline.
+ 
+      if (fContained) {
+         std::string suffix = fname.substr(fFile.size());
+         install_flush_handlers();
+         return new container_stream(get_container(
+                                        file_stem(options().container) +
+                                        suffix), fChannel);
+      }
+      std::ofstream *out = new std::ofstream;
+      if (fBuffered) {
+         fBuffers.push_back(std::vector<char>(options().write_buffer));
+         out->rdbuf()->pubsetbuf(fBuffers.back().data(),
+                                 fBuffers.back().size());
+         install_flush_handlers();
+      }
+      out->open(fname.c_str(), std::ios::out | std::ios::binary);
+#if DILOG_ZLIB
+      if (options().compress_output)
+         return new frame_ostream(out, options().compress_frame);
+#endif
+      return out;
+   }
+
+   bool read_line(std::string &msg)
+   {
+    // Read the next line from the input file into msg, decoding it
+    // into the text form if the input is in the binary format, and
+    // leave the size in bytes of the record that was read in fLastlen.
+    // The return value is false only on an unrecoverable stream error,
+    // with end-of-file reported by the fail state of the stream, and
+    // once the check has stopped, see save_actual. With options().stop_at
+    // set, the input ends at the line of that checkpoint, so that the
+    // search for a message that fails stops there.
+ 
+      if (fActual) {
+         msg.clear();
+         return false;
+      }
+      if (fLineno >= fLastLine) {
+         msg.clear();
+         fReading->setstate(std::ios::eofbit | std::ios::failbit);
+         return true;
+      }
+      if (!fBinary) {
+         if (fMapped) {
+            const char *start = fMapped->cur();
+            size_t avail = fMapped->end() - start;
+            const char *eol = (const char*)memchr(start, '\n', avail);
+            if (avail == 0 || fReading->fail()) {
+               msg.clear();
+               fReading->setstate(std::ios::eofbit | std::ios::failbit);
+               return true;
+            }
+            size_t len = (eol)? eol - start : avail;
+            msg.assign(start, len);
+            fLastlen = (eol)? len + 1 : len;
+            fMapped->skip(fLastlen);
+            ++fStats.lines_read;
+            fStats.bytes_read += fLastlen;
+            return true;
          }
+         bool ok = !std::getline(*fReading, msg).bad();
+         fLastlen = msg.size() + 1;
+         if (!fReading->fail()) {
+            ++fStats.lines_read;
+            fStats.bytes_read += fLastlen;
+         }
+         return ok;
       }
-      delete msg;
-      return bytes;
+      int stat = read_record(*fReading, true, fPaths, msg, fLastlen);
+      if (stat > 0) {
+         ++fStats.lines_read;
+         fStats.bytes_read += fLastlen;
+      }
+      if (stat < 0) {
+         fError = "read error from input file " + fInput + ".dilog"
+                  " after line " + std::to_string(fLineno) +
+                  ": corrupt record found in binary dilog file";
+         clean_exit("dilog::read_line");
+      }
+      return !fReading->bad();
    }
 
-   int get_lineno() const {
-      return fLineno;
+   void write_block(char tag, unsigned int pathid)
+   {
+    // Write a block entry (tag = DILOG_TAG_ENTER) or exit (tag =
+    // DILOG_TAG_EXIT) line for the block path with id pathid to the
+    // output file.
+ 
+      if (fBinary) {
+         write_record(tag, path_id(pathid), 0, 0);
+      }
+      else {
+         const std::string &path = fNodes[pathid].path;
+         endline(*fWriting << tag << path << tag);
+         fStats.bytes_written += path.size() + 3;
+      }
    }
 
- protected:
-   dilog() = delete;
+   uint32_t path_id(unsigned int pathid)
+   {
+    // Return the id in the binary output file of the block path with id
+    // pathid on this channel, writing a new path definition record into
+    // the file on first use.
+ 
+      if (pathid < fPathIds.size() && fPathIds[pathid] != (uint32_t)-1)
+         return fPathIds[pathid];
+      if (pathid >= fPathIds.size())
+         fPathIds.resize(pathid + 1, -1);
+      uint32_t id = fPathNodes.size();
+      fPathIds[pathid] = id;
+      fPathNodes.push_back(pathid);
+      const std::string &path = fNodes[pathid].path;
+      write_record(DILOG_TAG_PATH, id, path.data(), path.size());
+      return id;
+   }
 
-   void check_message(const std::string message)
+   void write_record(char tag, uint32_t id, const char *data, size_t len)
    {
-    // Validate printf message against the next content found in the input
-    // file, and report a fatal error if the match fails.
+      fStats.bytes_written += write_record(*fWriting, tag, id, data, len);
+      if (!fBuffered)
+         fWriting->flush();
+   }
+
+   static size_t write_record(std::ostream &out, char tag, uint32_t id,
+                              const char *data, size_t len)
+   {
+    // Write a single record to a binary output file, consisting of
+    // the tag byte, the path id and payload length as varints, the
+    // payload itself, and the 32-bit record hash. Returns the size of
+    // the record in bytes.
  
-      size_t nl;
-      std::string msg(message);
-      while ((nl = msg.find('\n')) != msg.npos)
-         msg.erase(nl);
-      std::string mexpected = "[" + fBlock->getPath() + "]" + msg;
-      std::string nextmsg;
-      for (; !std::getline(*fReading, nextmsg).bad();) {
-         ++fLineno;
-         verify_line(nextmsg, fLineno);
-         int nextline = fLineno;
-         if (nextmsg == mexpected) {
-            return;
+      char head[1 + 2 * DILOG_VARINT_MAX];
+      head[0] = tag;
+      size_t hlen = 1 + put_varint(head + 1, id);
+      hlen += put_varint(head + hlen, len);
+      uint32_t hash = record_hash(tag, id, data, len);
+      out.write(head, hlen);
+      out.write(data, len);
+      out.write((char*)&hash, sizeof(hash));
+      return hlen + len + sizeof(hash);
+   }
+
+   static size_t put_varint(char *buf, uint64_t value)
+   {
+      size_t n = 0;
+      for (; value > 0x7f; value >>= 7)
+         buf[n++] = (char)(0x80 | (value & 0x7f));
+      buf[n++] = (char)value;
+      return n;
+   }
+
+   static bool get_varint(std::istream &in, uint64_t &value, size_t &nbytes)
+   {
+      value = 0;
+      for (unsigned int shift=0; shift < 64; shift += 7) {
+         int c = in.get();
+         if (c == EOF)
+            return false;
+         ++nbytes;
+         value |= (uint64_t)(c & 0x7f) << shift;
+         if ((c & 0x80) == 0)
+            return true;
+      }
+      return false;
+   }
+
+   static uint32_t record_hash(char tag, uint32_t id,
+                               const char *data, size_t len)
+   {
+    // 32-bit FNV-1a hash over the contents of a binary record
+ 
+      uint32_t hash = 2166136261u;
+      hash = (hash ^ (unsigned char)tag) * 16777619u;
+      for (int i=0; i < 4; ++i, id >>= 8)
+         hash = (hash ^ (id & 0xff)) * 16777619u;
+      for (size_t i=0; i < len; ++i)
+         hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+      return hash;
+   }
+
+   static bool is_binary(std::istream &in)
+   {
+      char magic[DILOG_BINARY_HEADER];
+      in.read(magic, DILOG_BINARY_HEADER);
+      return (in.gcount() == DILOG_BINARY_HEADER &&
+              memcmp(magic, DILOG_BINARY_MAGIC, DILOG_BINARY_HEADER) == 0);
+   }
+
+   static char parse_record(const std::string &line,
+                            std::string &path, std::string &payload)
+   {
+    // Split a dilog file line in text form into its block path and
+    // message payload, and return its record tag, or 0 if the line is
+    // not a well-formed dilog record.
+ 
+      size_t sep = line.find(']');
+      if (line.size() > 1 && line[0] == '[' && line.back() == '[' &&
+          sep == line.npos)
+      {
+         path = line.substr(1, line.size() - 2);
+         return DILOG_TAG_ENTER;
+      }
+      else if (line.size() > 1 && line[0] == ']' && line.back() == ']') {
+         path = line.substr(1, line.size() - 2);
+         return DILOG_TAG_EXIT;
+      }
+      else if (line.size() > 1 && line[0] == '[' && sep != line.npos) {
+         path = line.substr(1, sep - 1);
+         payload = line.substr(sep + 1);
+         return DILOG_TAG_MESSAGE;
+      }
+      return 0;
+   }
+
+   static int read_record(std::istream &in, bool binary,
+                          std::vector<std::string> &paths,
+                          std::string &line, size_t &nbytes)
+   {
+    // Read the next line from dilog input stream in, in text or binary
+    // format, and return it in text form in line with its size in bytes
+    // in nbytes. Path definition records in binary input are absorbed
+    // into the paths table along the way. The return value is 1 on
+    // success, 0 at end of file, or -1 if a corrupt record was found.
+ 
+      nbytes = 0;
+      if (!binary) {
+         if (!std::getline(in, line))
+            return 0;
+         nbytes = line.size() + 1;
+         return 1;
+      }
+      while (true) {
+         int tag = in.get();
+         if (tag == EOF)
+            return 0;
+         uint64_t id, len;
+         ++nbytes;
+         if (!get_varint(in, id, nbytes) || !get_varint(in, len, nbytes))
+            return -1;
+         // The payload is read a chunk at a time, so that a corrupt
+         // length cannot allocate more than the stream really holds.
+         std::string payload;
+         while (payload.size() < len) {
+            size_t start = payload.size();
+            payload.resize(start + std::min(len - start,
+                                            (uint64_t)DILOG_CHUNK_SIZE));
+            if (!in.read(&payload[start], payload.size() - start))
+               return -1;
+         }
+         uint32_t hash;
+         if (!in.read((char*)&hash, sizeof(hash)) ||
+             hash != record_hash(tag, id, payload.data(), len))
+         {
+            return -1;
+         }
+         nbytes += len + sizeof(hash);
+         if (tag == DILOG_TAG_PATH) {
+            if (id > paths.size())
+               return -1;
+            else if (id == paths.size())
+               paths.push_back(payload);
+            else if (paths[id] != payload)
+               return -1;
+            continue;
+         }
+         else if (id >= paths.size()) {
+            return -1;
+         }
+         else if (tag == DILOG_TAG_MESSAGE) {
+            line = std::string("[") + paths[id] + "]" + payload;
+         }
+         else if (tag == DILOG_TAG_ENTER || tag == DILOG_TAG_EXIT) {
+            line = (char)tag + paths[id] + (char)tag;
          }
          else {
-            trace t(*fBlock, "check_message", "next");
-            if (fBlock->next(nextmsg)) {
-               continue;
+            return -1;
+         }
+         return 1;
+      }
+   }
+
+ public:
+   static bool convert(const std::string &infile, const std::string &outfile,
+                       bool binary)
+   {
+    // Convert dilog file infile, in either format, into outfile in the
+    // binary format if binary is true, otherwise into the text format.
+    // Returns false with a message to stderr if the conversion failed.
+ 
+      std::unique_ptr<std::istream> pin(open_file(infile));
+      if (!pin) {
+         std::cerr << "dilog::convert error - unable to open input file "
+                   << infile << std::endl;
+         return false;
+      }
+      std::istream &in = *pin;
+      bool inbinary = is_binary(in);
+      in.clear();
+      in.seekg((inbinary)? DILOG_BINARY_HEADER : 0);
+      std::ofstream out(outfile.c_str(), std::ios::out | std::ios::binary);
+      if (!out.good()) {
+         std::cerr << "dilog::convert error - unable to open output file "
+                   << outfile << std::endl;
+         return false;
+      }
+      if (binary)
+         out.write(DILOG_BINARY_MAGIC, DILOG_BINARY_HEADER);
+      std::vector<std::string> paths;
+      std::map<std::string, uint32_t> pathids;
+      std::string line;
+      size_t nbytes;
+      int stat;
+      for (int lineno=1; (stat = read_record(in, inbinary, paths,
+                                             line, nbytes)) > 0; ++lineno)
+      {
+         if (!binary) {
+            out << line << '\n';
+            continue;
+         }
+         std::string path, payload;
+         char tag = parse_record(line, path, payload);
+         if (tag == 0) {
+            std::cerr << "dilog::convert error - unrecognized line "
+                      << lineno << " in input file " << infile << std::endl;
+            return false;
+         }
+         auto iter = pathids.find(path);
+         if (iter == pathids.end()) {
+            iter = pathids.insert(std::make_pair(path,
+                                  (uint32_t)pathids.size())).first;
+            write_record(out, DILOG_TAG_PATH, iter->second,
+                         path.data(), path.size());
+         }
+         write_record(out, tag, iter->second, payload.data(), payload.size());
+      }
+      if (stat < 0) {
+         std::cerr << "dilog::convert error - corrupt record found in "
+                   << "input file " << infile << std::endl;
+         return false;
+      }
+      return out.good();
+   }
+
+   static int compare(const std::string &file1, const std::string &file2,
+                      std::ostream &report, unsigned int skip1=0)
+   {
+    // Compare dilog files file1 and file2, in either format, under the
+    // rules of a check run of one against the other: the messages of a
+    // block iteration must agree in order, while the iterations within
+    // each set of iterations of a block may come in any order. Each file
+    // is first reduced to a digest of its complete contents, in which
+    // the digests of the iterations of every block set are sorted, with
+    // the two files read in parallel. Only if the digests differ are the
+    // two files walked together, one block level at a time, to find the
+    // first point of divergence, which is described in report. The first
+    // skip1 lines of file1 are passed over, eg. to compare the part of a
+    // recorded file that follows the line where a .dilog.actual file
+    // starts, see save_actual. Returns 0 if the files agree, 1 if they
+    // diverge, or -1 on a read error.
+ 
+      stream_reader in1(file1), in2(file2);
+      for (stream_reader *in : {&in1, &in2}) {
+         if (!in->good()) {
+            report << "dilog::compare error - unable to open input file "
+                   << in->name() << std::endl;
+            return -1;
+         }
+      }
+      in1.skip(skip1);
+      uint64_t digest1;
+      std::thread worker([&] { digest1 = stream_digest(in1); });
+      uint64_t digest2 = stream_digest(in2);
+      worker.join();
+      for (stream_reader *in : {&in1, &in2}) {
+         if (in->failed()) {
+            report << "dilog::compare error - corrupt record at line "
+                   << in->lineno() << " in input file " << in->name()
+                   << std::endl;
+            return -1;
+         }
+      }
+      if (digest1 == digest2)
+         return 0;
+      in1.seek(in1.start(), in1.startline());
+      in2.seek(in2.start(), in2.startline());
+      locate(in1, in2, report);
+      return 1;
+   }
+
+ protected:
+
+   class stream_reader {
+
+    // Sequential reader of the records of a dilog file, in either format,
+    // for dilog::compare. The reader keeps the path table of a binary file
+    // as it goes, so it can be sent back to any record it has passed with
+    // seek, and the last record read can be pushed back with hold.
+
+    public:
+      stream_reader(const std::string &fname)
+       : fName(fname), fIn(0), fMapped(0), fStartLine(0), fTag(0),
+         fHeld(false), fFailed(false)
+      {
+#if DILOG_MMAP
+         if (!is_compressed(fname)) {
+            fMapped = new mapped_buffer(fname);
+            if (fMapped->good()) {
+               fIn = new std::istream(fMapped);
+            }
+            else {
+               delete fMapped;
+               fMapped = 0;
             }
          }
-         fError = "expected dilog message"
-                  " \"" + mexpected + "\" at line " + std::to_string(nextline)
-                  + " in " + fChannel + ".dilog but found \"" 
-                  + nextmsg + "\" instead, search stopped at line " +
-                  std::to_string(fLineno);
-         clean_exit("dilog::check_message");
+#endif
+         if (fIn == 0) {
+            fIn = open_file(fname);
+            if (fIn == 0)
+               return;
+         }
+         fBinary = is_binary(*fIn);
+         fStart = (fBinary)? DILOG_BINARY_HEADER : 0;
+         seek(fStart, 0);
       }
-      fError = "read error from input file " +
-               fChannel + ".dilog after line " + std::to_string(fLineno) +
-               ": expected \"" + mexpected + "\" but found end-of-file.";
-      clean_exit("dilog::check_message");
+
+      ~stream_reader() {
+         if (fIn)
+            delete fIn;
+         if (fMapped)
+            delete fMapped;
+      }
+
+      bool good() const { return fIn != 0; }
+      bool failed() const { return fFailed; }
+      const std::string &name() const { return fName; }
+      uint64_t start() const { return fStart; }
+      unsigned int startline() const { return fStartLine; }
+      uint64_t offset() const { return fOffset; }
+      unsigned int lineno() const { return fLineno; }
+      const std::string &line() const { return fLine; }
+      const std::string &path() const { return fPath; }
+
+      void seek(uint64_t offset, unsigned int lineno)
+      {
+         // Position the reader at the record starting at offset, which
+         // follows line lineno.
+
+         fIn->clear();
+         fIn->seekg(offset);
+         fPos = offset;
+         fLineno = lineno;
+         fHeld = false;
+      }
+
+      char next()
+      {
+         // Read the next record and return its tag, or 0 at end of file
+         // or if the record is corrupt, in which case failed() is true.
+
+         if (fHeld) {
+            fHeld = false;
+            return fTag;
+         }
+         size_t nbytes;
+         fOffset = fPos;
+         int stat = read_record(*fIn, fBinary, fPaths, fLine, nbytes);
+         if (stat <= 0) {
+            fFailed |= (stat < 0);
+            fLine.clear();
+            return fTag = 0;
+         }
+         fPos += nbytes;
+         ++fLineno;
+         fTag = parse_record(fLine, fPath, fPayload);
+         fFailed |= (fTag == 0);
+         return fTag;
+      }
+
+      void hold()
+      {
+         // Return the last record again from the next call to next().
+
+         fHeld = true;
+      }
+
+      void skip(unsigned int nlines)
+      {
+         // Pass over the next nlines records, and start the file from the
+         // one after them.
+
+         for (unsigned int n=0; n < nlines && next() != 0; ++n) {}
+         fStart = fPos;
+         fStartLine = fLineno;
+      }
+
+    private:
+      std::string fName;
+      std::istream *fIn;
+      mapped_buffer *fMapped;
+      bool fBinary;
+      uint64_t fStart;             // offset of the first record
+      unsigned int fStartLine;     // line preceding it
+      uint64_t fPos;               // offset of the next record
+      uint64_t fOffset;            // offset of the last record read
+      unsigned int fLineno;        // line number of the last record read
+      std::string fLine;           // last record read, in text form
+      std::string fPath;           // block path of the last record
+      std::string fPayload;        // message of the last record
+      std::vector<std::string> fPaths;
+      char fTag;
+      bool fHeld;
+      bool fFailed;
+   };
+
+   struct stream_item {
+
+    // One entry in a block iteration read by stream_reader: a message,
+    // a whole set of iterations of an inner block, or the end of the
+    // block or file, with tag DILOG_TAG_MESSAGE, DILOG_TAG_ENTER,
+    // DILOG_TAG_EXIT or 0 respectively. Line and lineno are those of the
+    // first record of the entry. For a block set, iters lists the digest
+    // and position of the entry record of each iteration.
+ 
+      struct iteration {
+         uint64_t digest;
+         uint64_t offset;
+         unsigned int lineno;
+      };
+      char tag;
+      uint64_t digest;
+      unsigned int lineno;
+      std::string line;
+      std::vector<iteration> iters;
+   };
+
+   static uint64_t digest_mix(uint64_t hash, uint64_t digest)
+   {
+      return key_hash(hash, (const char*)&digest, sizeof(digest));
    }
 
-   void verify_line(std::string msg, int lineno)
+   static void stream_next(stream_reader &in, stream_item &item)
    {
-      std::streampos posaved = fReading->tellg();
-      fReading->clear();
-      fReading->seekg(0);
-      int line = 0;
-      std::string nextmsg;
-      for (; !std::getline(*fReading, nextmsg).bad();) {
-         if (++line == lineno)
+    // Read the next entry of the current block iteration from in.
+ 
+      item.tag = in.next();
+      item.lineno = in.lineno() + ((item.tag)? 0 : 1);
+      item.line = in.line();
+      item.iters.clear();
+      item.digest = key_hash(14695981039346656037ull,
+                             item.line.data(), item.line.size());
+      if (item.tag != DILOG_TAG_ENTER)
+         return;
+      std::string path = in.path();
+      std::vector<uint64_t> digests;
+      do {
+         stream_item::iteration iter = {0, in.offset(), in.lineno()};
+         iter.digest = stream_digest(in);
+         item.iters.push_back(iter);
+         digests.push_back(iter.digest);
+      } while (in.next() == DILOG_TAG_ENTER && in.path() == path);
+      in.hold();
+      std::sort(digests.begin(), digests.end());
+      for (uint64_t digest : digests)
+         item.digest = digest_mix(item.digest, digest);
+   }
+
+   static uint64_t stream_digest(stream_reader &in)
+   {
+    // Read the rest of the current block iteration from in, or the rest
+    // of the file at the top level, and return its digest.
+ 
+      uint64_t digest = 14695981039346656037ull;
+      stream_item item;
+      for (stream_next(in, item); item.tag == DILOG_TAG_MESSAGE ||
+                                  item.tag == DILOG_TAG_ENTER;
+           stream_next(in, item))
+      {
+         digest = digest_mix(digest, item.digest);
+      }
+      return key_hash(digest, item.line.data(), item.line.size());
+   }
+
+   static std::vector<uint64_t> stream_entries(stream_reader &in,
+                                        const stream_item::iteration &iter)
+   {
+    // Return the digests of the entries in block iteration iter.
+ 
+      std::vector<uint64_t> digests;
+      in.seek(iter.offset, iter.lineno - 1);
+      in.next();
+      stream_item item;
+      for (stream_next(in, item); item.tag == DILOG_TAG_MESSAGE ||
+                                  item.tag == DILOG_TAG_ENTER;
+           stream_next(in, item))
+      {
+         digests.push_back(item.digest);
+      }
+      return digests;
+   }
+
+   static void locate(stream_reader &in1, stream_reader &in2,
+                      std::ostream &report)
+   {
+    // Walk the rest of the current block iterations in in1 and in2
+    // together, or the rest of the files at the top level, and describe
+    // the first divergence found in report. When the same block set is
+    // found with different iterations, the first iteration in in2 that
+    // has no equal in in1 is compared with the unmatched iteration in in1
+    // that agrees with it the longest, the same way one level further
+    // down.
+ 
+      stream_item item1, item2;
+      while (true) {
+         stream_next(in1, item1);
+         stream_next(in2, item2);
+         if (item1.tag != item2.tag || item1.digest != item2.digest)
             break;
+         else if (item1.tag != DILOG_TAG_MESSAGE &&
+                  item1.tag != DILOG_TAG_ENTER)
+            return;
       }
-      if (line != lineno) {
-         fError = "error on file " + fChannel + ".dilog at line " +
-                  std::to_string(line) + ": end of file " + fChannel +
-                  " found seeking line " + std::to_string(lineno);
-         clean_exit("dilog::verify_line");
+      if (item1.tag != DILOG_TAG_ENTER || item2.tag != DILOG_TAG_ENTER ||
+          item1.line != item2.line)
+      {
+         locate_report(in1, item1, in2, item2, report);
+         return;
       }
-      else if (nextmsg != msg) {
-         fError = "error on line " + std::to_string(line) +
-                  ": found \"" + nextmsg + "\" at line " +
-                  std::to_string(lineno) + " of file " +
-                  fChannel + ", expected \"" + msg + "\"";
-         clean_exit("dilog::verify_line");
+      std::unordered_multimap<uint64_t, size_t> unmatched;
+      for (size_t i=0; i < item1.iters.size(); ++i)
+         unmatched.insert(std::make_pair(item1.iters[i].digest, i));
+      size_t first = item2.iters.size();
+      for (size_t i=0; i < item2.iters.size(); ++i) {
+         auto match = unmatched.find(item2.iters[i].digest);
+         if (match != unmatched.end())
+            unmatched.erase(match);
+         else if (first == item2.iters.size())
+            first = i;
       }
-      fReading->clear();
-      fReading->seekg(posaved);
+      if (first == item2.iters.size() || unmatched.size() == 0) {
+         // One of the sets has more iterations than the other, so the
+         // divergence is at the first extra iteration, compared with the
+         // entry following the set in the other file.
+         stream_item &more = (unmatched.size() > 0)? item1 : item2;
+         stream_item &less = (unmatched.size() > 0)? item2 : item1;
+         size_t extra = first;
+         for (auto &left : unmatched)
+            extra = std::min(extra, left.second);
+         more.lineno = more.iters[extra].lineno;
+         stream_reader &inless = (unmatched.size() > 0)? in2 : in1;
+         stream_next(inless, less);
+         locate_report(in1, item1, in2, item2, report);
+         return;
+      }
+      std::vector<uint64_t> target = stream_entries(in2, item2.iters[first]);
+      size_t best = item1.iters.size();
+      size_t best_length = 0;
+      for (auto &left : unmatched) {
+         std::vector<uint64_t> cand = stream_entries(in1,
+                                                     item1.iters[left.second]);
+         size_t length = std::mismatch(target.begin(), target.begin() +
+                                       std::min(target.size(), cand.size()),
+                                       cand.begin()).first - target.begin();
+         if (best == item1.iters.size() || length > best_length ||
+             (length == best_length && left.second < best))
+         {
+            best = left.second;
+            best_length = length;
+         }
+      }
+      in1.seek(item1.iters[best].offset, item1.iters[best].lineno - 1);
+      in1.next();
+      in2.seek(item2.iters[first].offset, item2.iters[first].lineno - 1);
+      in2.next();
+      locate(in1, in2, report);
    }
 
-   void clean_exit(std::string src="")
+   static void locate_report(const stream_reader &in1,
+                             const stream_item &item1,
+                             const stream_reader &in2,
+                             const stream_item &item2, std::ostream &report)
    {
-      if (src.size() > 0)
-         std::cerr << "Fatal error from " << src << ": ";
-      std::cerr << fError << std::endl;
-      exit(9);
+      report << "first divergence at line " << item1.lineno << " in "
+             << in1.name() << " and line " << item2.lineno << " in "
+             << in2.name() << ":" << std::endl
+             << "< " << ((item1.tag)? item1.line : "end of file") << std::endl
+             << "> " << ((item2.tag)? item2.line : "end of file") << std::endl;
+   }
+
+   void endline(std::ostream &out)
+   {
+    // Terminate a line written to one of the output files, flushing
+    // the stream after every line unless buffered output is enabled.
+ 
+      if (fBuffered)
+         out << '\n';
+      else
+         out << std::endl;
+   }
+
+   void flush(bool wait=true)
+   {
+    // Flush the output files of this channel. In async mode, this also
+    // drains the output ring, unless wait is false and the background
+    // writer is draining it already.
+ 
+      if (fWriting)
+         fWriting->flush();
+      if (fAsync)
+         fAsync->drain(wait);
+      if (fLogging)
+         fLogging->flush();
+   }
+
+   static void flush_all()
+   {
+    // Flush the output files of all open channels. This is called at
+    // exit and from the fatal signal handler in buffered mode, where no
+    // locks can be taken, so it must not run concurrently with the
+    // creation of new channels.
+ 
+      for (auto iter : get_map())
+         iter.second->flush(false);
+   }
+
+   typedef void (*signal_handler_t)(int);
+
+   static signal_handler_t *saved_handlers()
+   {
+      static signal_handler_t handlers[NSIG];
+      return handlers;
+   }
+
+   static void flush_on_signal(int sig)
+   {
+      flush_all();
+      signal(sig, saved_handlers()[sig]);
+      raise(sig);
+   }
+
+   static void install_flush_handlers()
+   {
+    // Arrange for buffered output to reach the disk when the process
+    // exits or is killed by a fatal signal, as selected by the options
+    // flush_at_exit and flush_on_signal. Any handlers already installed
+    // for these signals are restored and invoked after the flush.
+ 
+      static bool installed(false);
+      if (installed)
+         return;
+      installed = true;
+      if (options().flush_at_exit)
+         atexit(flush_all);
+      if (options().flush_on_signal) {
+         int sigs[] = {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGINT, SIGSEGV,
+                       SIGTERM, SIGHUP, SIGQUIT};
+         for (int sig : sigs) {
+            signal_handler_t old = signal(sig, flush_on_signal);
+            saved_handlers()[sig] = (old == SIG_ERR)? SIG_DFL : old;
+         }
+      }
+   }
+
+   void logger(const std::string &line)
+   {
+      logger(line.data(), line.size());
    }
 
-   void logger(std::string line)
+   void logger(const char *line, size_t len)
    {
       if (fLogging) {
-         *fLogging << line << " at line " << fLineno
-                   << ", step " << fRecord.size() - 1
-                   << std::endl;
+         fLogging->write(line, len);
+         endline(*fLogging << " at line " << fLineno
+                           << ", step " << fRecord.size() - 1);
       }
    }
 
    unsigned int fLineno;                   // current line number in dilog file
    std::string fChannel;                   // name of this channel
-   std::ifstream *fReading;                // non-zero if reading
-   std::ofstream *fWriting;                // non-zero if writing
-   std::ofstream *fLogging;                // non-zero if writing
+   std::istream *fReading;                 // non-zero if reading
+   std::ostream *fWriting;                 // non-zero if writing
+   std::ostream *fLogging;                 // non-zero if writing
    block *fBlock;                          // current innermost block
-   std::map<std::string, block*> fBlocks;  // table of all active blocks
-   std::vector<std::string> fRecord;       // record of block actions for replay
+   record_list fRecord;                    // record of block actions for replay
    std::thread::id fThread_id;             // thread where this channel was created
    std::string fError;                     // pending error message on this channel
+   std::vector<char> fFormat;              // reusable buffer for printf lines
+   std::string fNextmsg;                   // reusable buffer for check_message
    unsigned int fReplay;                   // state flag indicating replay in progress
  
    // fMatched is a record of the line numbers in the input file that
-   // last matched the lines of the fRecord replay vector, keyed by index
-   // into the fRecord vector.
-   std::map<unsigned int, unsigned int> fMatched;
+   // last matched the lines of the fRecord replay vector, indexed by
+   // step in the fRecord vector, see set_matched.
+   std::vector<unsigned int> fMatched;
+
+   // fLineIndex is the table of stream offsets in the input file where
+   // each line ends, indexed by line number, with fLineIndex[0] = 0 for
+   // the start of the file. It is extended by verify_line as the reader
+   // advances, or loaded in full from <channel>.dilogx if one was saved.
+   // After a resume from a checkpoint, see checkpoint, it only covers
+   // the lines from fLineBase on, with fLineIndex[0] for fLineBase.
+   std::vector<std::streampos> fLineIndex;
+   unsigned int fLineBase;                 // line number of fLineIndex[0]
+   bool fIndexLoaded;                      // fLineIndex read from dilogx file
+   bool fBuffered;                         // output lines are not flushed
+   bool fBinary;                           // dilog file is in binary format
+   size_t fLastlen;                        // size of last record read
+   std::vector<std::string> fPaths;        // block paths by id, binary input
+   std::map<unsigned int, block_set> fSets; // block set indices by first line
+   set_scanner *fPrescan;                  // index of all block sets, or null
+   mapped_buffer *fMapped;                 // non-zero if input is in memory
+   bool fContained;                        // channel is kept in a container
+   block *fPendingBlock;                   // block of message being checked
+   std::string fPendingMsg;                // message being checked
+   unsigned int fPendingLine;              // line before the item being checked
+   std::deque<block_node> fNodes;          // tree of block paths by id
+   block *fDigesting;                      // digest-mode block being collected
+   uint64_t fDigest;                       // digest of iteration being collected
+   record_list fDigestRecord;              // contents of iteration being collected
+   std::vector<uint32_t> fPathIds;         // binary output ids by path id
+   std::vector<unsigned int> fPathNodes;   // path ids by binary output id
+   std::vector<std::vector<char> > fBuffers; // private output stream buffers
+   async_buffer *fAsync;                   // output ring of fWriting, async mode
+   size_t fRecordLimit;                    // records held before trim_record
+   stats_t fStats;                         // counters, see stats()
+   std::unordered_map<std::string, tolerance_t> fTolerance; // by block path
+   unsigned int fSkipping;                 // depth of blocks not sampled
+   std::atomic<task_context*> fTask;       // task owning this channel, or null
+   std::string fFile;                      // path of the files less suffix
+   std::string fInput;                     // same for the recorded files
+   std::ofstream *fCheckpoints;            // <channel>.dilogk in record mode
+   size_t fCheckpointPaths;                // binary paths saved in dilogk
+   std::map<std::string, checkpoint_t> fMarks; // checkpoints by marker
+   std::vector<std::string> fMarkPaths;    // binary paths saved in dilogk
+   bool fResuming;                         // skipping to options().resume_at
+   bool fStopped;                          // stopped at options().stop_at
+   unsigned int fLastLine;                 // line of that checkpoint, or -1
+   std::deque<attempt_t> fAttempts;        // iterations tried, see write_report
+   bool fActual;                           // saving the rest, see save_actual
+   bool fUnsettled;                        // see settle_actual
+   std::shared_ptr<std::atomic<bool> > fCached; // validity of cached pointers
 
  private:
    class dilogs_holder {
     public:
       dilogs_map_t fDilogs;
-      dilogs_holder() {}
+      async_writer *fWriter;
+      std::map<std::string, container*> fContainers;
+      std::unordered_set<std::string> fReleased;  // channels released so far
+      std::map<std::string, stats_t> fStats;      // stats of closed channels,
+                                                  // guarded by get_lock()
+      dilogs_holder() : fWriter(0) {
+         // Constructed first, so that they outlive the holder.
+         get_lock();
+         options();
+         watcher();
+      }
       ~dilogs_holder() {
+         watcher().stop();
          dilogs_map_t dilogs = get_map();
          for (auto iter : dilogs) {
             delete iter.second;
          }
+         if (options().collect_stats && fStats.size() > 0) {
+            stats_t total;
+            std::cerr << "dilog stats:" << std::endl;
+            stats_t::print_header(std::cerr);
+            for (auto &iter : fStats) {
+               iter.second.print(std::cerr, iter.first);
+               total.add(iter.second);
+            }
+            if (fStats.size() > 1)
+               total.print(std::cerr, "total");
+         }
+         if (fWriter)
+            delete fWriter;
+         for (auto iter : fContainers)
+            delete iter.second;
       }
    };
 
-   static dilogs_map_t& get_map() {
+   static dilogs_holder& get_holder() {
       static dilogs_holder holder;
-      return holder.fDilogs;
+      return holder;
+   }
+
+   static dilogs_map_t& get_map() {
+      return get_holder().fDilogs;
+   }
+
+   static container& get_container(const std::string &name) {
+      // Containers are opened by the first channel that needs them, for
+      // reading if it holds recorded streams and the directory file
+      // <name>d exists, or else for writing.
+      static std::mutex mutex;
+      std::lock_guard<std::mutex> guard(mutex);
+      dilogs_holder &holder = get_holder();
+      container *&store = holder.fContainers[name];
+      if (store == 0) {
+         std::ifstream dir((name + "d").c_str());
+         bool recorded = (name.size() > 6 &&
+                          name.compare(name.size() - 6, 6, ".dilog") == 0);
+         store = new container(name, recorded && dir.good());
+      }
+      return *store;
+   }
+
+   static async_writer& get_writer() {
+      // The background writer thread is started by the first channel
+      // opened for writing in async mode.
+      static std::mutex mutex;
+      std::lock_guard<std::mutex> guard(mutex);
+      dilogs_holder &holder = get_holder();
+      if (holder.fWriter == 0)
+         holder.fWriter = new async_writer;
+      return *holder.fWriter;
+   }
+
+   struct cache_entry {
+      dilog *dlog;                                   // channel owned here
+      std::shared_ptr<std::atomic<bool> > valid;     // see invalidate_caches
+   };
+
+   struct thread_cache {
+      const cache_entry *last;                       // most recent lookup
+      std::unordered_map<std::string, cache_entry> table; // by channel name
+      size_t limit;                                  // size for next prune
+      thread_cache() : last(0), limit(64) {}
+      void prune() {
+         // Drop the entries of channels that have been released since,
+         // at intervals that grow with the number still held.
+         for (auto iter = table.begin(); iter != table.end();) {
+            if (iter->second.valid->load(std::memory_order_acquire))
+               ++iter;
+            else
+               iter = table.erase(iter);
+         }
+         last = 0;
+         limit = std::max((size_t)64, 2 * table.size());
+      }
+   };
+
+   static std::mutex& get_lock() {
+      // Held by get and release while looking up channels by name
+      // and adding or removing them, but never while deleting a channel.
+      static std::mutex mutex;
+      return mutex;
+   }
+
+   static uint64_t thread_token() {
+      // Nonzero number unique to the calling thread, see task_context.
+      static std::atomic<uint64_t> next(1);
+      static thread_local uint64_t token = next++;
+      return token;
+   }
+
+   static thread_cache& get_cache() {
+      static thread_local thread_cache cache;
+      return cache;
    }
 };
 